@@ -0,0 +1,818 @@
+/*
+ 
+ Simple FTP
+ 
+ Version: 1.0
+ GitHub repository: https://github.com/fortesit/simple-ftp
+ Author: Sit King Lok
+ Last modified: 2014-09-30 22:11
+ 
+ Description:
+ Client library with session pooling and asynchronous transfers, see libmyftp.h
+ 
+ */
+
+# include <stdio.h>
+# include <stdlib.h>
+# include <unistd.h>
+# include <string.h>
+# include <errno.h>
+# include <poll.h>
+# include <pthread.h>
+# include <sys/socket.h>
+# include <sys/types.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <arpa/inet.h>
+# include <fcntl.h>
+# include <sys/stat.h>
+# include <utime.h>
+# include "myftp.h"
+# include "myftppipe.h"
+# include "libmyftp.h"
+
+# define LIST_PAGE_SIZE 256
+
+struct myftp_session {
+	int sd;	/* -1 once the connection is gone */
+	int authenticated;
+	int has_token;
+	struct myftp_token token;	/* from the last login, for myftp_resume() */
+	myftp_session *next;	/* idle list of the pool */
+};
+
+struct myftp_job {
+	int upload;
+	char *remote, *local;
+	myftp_callback callback;
+	void *arg;
+	struct myftp_job *next;
+};
+
+struct myftp_pool {
+	char ip[64], user[40], password[40];
+	int port;
+	int has_token;
+	struct myftp_token token;	/* newest one any of our sessions got */
+	int max_sessions, open_sessions;
+	myftp_session *idle;
+	struct myftp_job *head, *tail;
+	int pending;	/* queued or running jobs */
+	int stopping;
+	pthread_t *threads;
+	int thread_count;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+};
+
+static const char myftp_protocol[6] = {0xe3,'m','y','f','t','p'};
+
+static int send_packet(int sd, const void* buffer, int length)
+{
+	int sentLength = 0;
+	while (sentLength < length) {
+		int len = send(sd, buffer + sentLength, length - sentLength, PIPE_SEND_FLAGS);
+		if (len < 0) {
+			break;
+		}
+		sentLength += len;
+	}
+	return sentLength;
+}
+
+static int receive_packet(int sd, void* buffer, int length)
+{
+	int receivedLength = 0;
+	while (receivedLength < length) {
+		int len = recv(sd, buffer + receivedLength, length - receivedLength, 0);
+		if (len <= 0) {
+			break;
+		}
+		receivedLength += len;
+	}
+	return receivedLength;
+}
+
+static void set_header(struct message_s *message, unsigned char type, unsigned char status, int length)
+{
+	memcpy(message->protocol, myftp_protocol, 6);
+	message->type = type;
+	message->status = status;
+	message->length = htonl(length);
+	return;
+}
+
+// Read a reply header, false if it is not of the expected type
+static int receive_reply(myftp_session *session, struct message_s *reply, unsigned char type)
+{
+	if (receive_packet(session->sd, reply, 12) < 12 || memcmp(reply->protocol, myftp_protocol, 6) != 0 || (unsigned char)reply->type != type) {
+		return 0;
+	}
+	reply->length = ntohl(reply->length);
+	return reply->length >= 12;
+}
+
+// The peer is out of step, nothing more can be said on this connection
+static int broken(myftp_session *session)
+{
+	int saved = errno;
+	close(session->sd);
+	session->sd = -1;
+	session->authenticated = 0;
+	errno = saved;
+	return MYFTP_ERR_PROTOCOL;
+}
+
+static unsigned long long stat_field(unsigned int hi, unsigned int lo)
+{
+	return ((unsigned long long)ntohl(hi) << 32) | ntohl(lo);
+}
+
+static void unpack_stat(struct myftp_info *info, struct myftp_stat *ms)
+{
+	info->size = stat_field(ms->size_hi, ms->size_lo);
+	info->mtime = (time_t)stat_field(ms->mtime_hi, ms->mtime_lo);
+	info->hash = stat_field(ms->hash_hi, ms->hash_lo);
+	return;
+}
+
+const char *myftp_strerror(int result)
+{
+	switch (result) {
+		case MYFTP_OK:
+			return "Success.";
+		case MYFTP_UNCHANGED:
+			return "File not modified.";
+		case MYFTP_ERR_ADDRESS:
+			return "Please specify a correct IP address and port number.";
+		case MYFTP_ERR_CONNECT:
+			return "Cannot connect to the server.";
+		case MYFTP_ERR_REFUSED:
+			return "Server refused to connect.";
+		case MYFTP_ERR_PROTOCOL:
+			return "Received wrong data. Connection closed.";
+		case MYFTP_ERR_AUTH:
+			return "Authentication rejected. Connection closed.";
+		case MYFTP_ERR_STATE:
+			return "You were not granted authentication.";
+		case MYFTP_ERR_NOT_FOUND:
+			return "The file is not existed.";
+		case MYFTP_ERR_LOCAL:
+			return "Cannot access the local file.";
+	}
+	return "Unknown error.";
+}
+
+// Read the token that may follow a login reply of the given length
+static int receive_token(myftp_session *session, int length)
+{
+	if (length == 12 + sizeof(struct myftp_token)) {
+		if (receive_packet(session->sd, &session->token, sizeof(struct myftp_token)) < (int)sizeof(struct myftp_token)) {
+			return 0;
+		}
+		session->has_token = 1;
+	}
+	return length == 12 || session->has_token;
+}
+
+// Connect and send OPEN_CONN_REQUEST, logging in at once if it carries a password or token
+static myftp_session *open_session(const char *ip, int port, unsigned char status, const void *payload, int len_of_payload, int *result)
+{
+	struct sockaddr_in server_addr;
+	struct message_s OPEN_CONN_REPLY;
+	char request[12 + 256];
+	myftp_session *session;
+	int sd, saved, on = 1;
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = inet_addr(ip);
+	server_addr.sin_port = htons(port);
+	if (port <= 0 || port > 65535 || server_addr.sin_addr.s_addr == (in_addr_t)-1) {
+		*result = MYFTP_ERR_ADDRESS;
+		return NULL;
+	}
+	sd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+		saved = errno;
+		close(sd);
+		errno = saved;
+		*result = MYFTP_ERR_CONNECT;
+		return NULL;
+	}
+
+	// requests are small and lock-step, do not let Nagle hold them back
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+# ifdef SO_NOSIGPIPE
+	// no MSG_NOSIGNAL here, a server that closed the session must not kill our host
+	setsockopt(sd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+# endif
+	session = (myftp_session *)calloc(1, sizeof(myftp_session));
+	session->sd = sd;
+
+	// send OPEN_CONN_REQUEST and wait for OPEN_CONN_REPLY
+	set_header((struct message_s *)request, 0xA1, status, 12 + len_of_payload);
+	memcpy(request + 12, payload, len_of_payload);
+	send_packet(sd, request, 12 + len_of_payload);
+	if (!receive_reply(session, &OPEN_CONN_REPLY, 0xA2) || !receive_token(session, OPEN_CONN_REPLY.length)) {
+		*result = broken(session);
+	} else if (OPEN_CONN_REPLY.status != 1 && OPEN_CONN_REPLY.status != MYFTP_LOGGED_IN) {
+		broken(session);
+		*result = MYFTP_ERR_REFUSED;
+	} else {
+		session->authenticated = OPEN_CONN_REPLY.status == MYFTP_LOGGED_IN;
+		*result = MYFTP_OK;
+		return session;
+	}
+	free(session);
+	return NULL;
+}
+
+myftp_session *myftp_open(const char *ip, int port, int *result)
+{
+	return open_session(ip, port, 0, NULL, 0, result);
+}
+
+int myftp_auth(myftp_session *session, const char *user, const char *password)
+{
+	struct message_s AUTH_REPLY;
+	char request[12 + 80];
+	int len_of_request;
+
+	if (session == NULL || session->sd < 0 || session->authenticated) {
+		return MYFTP_ERR_STATE;
+	}
+
+	// send AUTH_REQUEST, the payload is "user password", and ask for a token
+	len_of_request = 12 + snprintf(request + 12, sizeof(request) - 12, "%.39s %.39s", user, password) + 1;
+	set_header((struct message_s *)request, 0xA3, MYFTP_RESUME, len_of_request);
+	send_packet(session->sd, request, len_of_request);
+
+	// wait and receive AUTH_REPLY
+	if (!receive_reply(session, &AUTH_REPLY, 0xA4) || (AUTH_REPLY.status != 0 && !receive_token(session, AUTH_REPLY.length))) {
+		return broken(session);
+	}
+	if (AUTH_REPLY.status == 0) {
+		broken(session);
+		return MYFTP_ERR_AUTH;
+	}
+	session->authenticated = 1;
+	return MYFTP_OK;
+}
+
+int myftp_logged_in(const myftp_session *session)
+{
+	return session != NULL && session->authenticated;
+}
+
+myftp_session *myftp_connect(const char *ip, int port, const char *user, const char *password, int *result)
+{
+	char payload[80];
+	int len_of_payload = snprintf(payload, sizeof(payload), "%.39s %.39s", user, password) + 1;
+	myftp_session *session = open_session(ip, port, MYFTP_WITH_AUTH, payload, len_of_payload, result);
+
+	if (session != NULL && !session->authenticated) {
+		myftp_close(session);
+		*result = MYFTP_ERR_AUTH;
+		session = NULL;
+	}
+	return session;
+}
+
+myftp_session *myftp_resume(const char *ip, int port, const struct myftp_token *token, const char *user, const char *password, int *result)
+{
+	myftp_session *session = open_session(ip, port, MYFTP_RESUME, token, sizeof(struct myftp_token), result);
+
+	// an expired or revoked token leaves the session open for a normal login
+	if (session != NULL && !session->authenticated) {
+		*result = user != NULL ? myftp_auth(session, user, password) : MYFTP_ERR_AUTH;
+		if (*result != MYFTP_OK) {
+			myftp_close(session);
+			session = NULL;
+		}
+	}
+	return session;
+}
+
+int myftp_get_token(const myftp_session *session, struct myftp_token *token)
+{
+	if (session == NULL || !session->has_token) {
+		return MYFTP_ERR_STATE;
+	}
+	memcpy(token, &session->token, sizeof(struct myftp_token));
+	return MYFTP_OK;
+}
+
+int myftp_list(myftp_session *session, const char *pattern, myftp_list_callback callback, void *arg)
+{
+	struct message_s LIST_REQUEST, LIST_REPLY;
+	struct myftp_list_request list_request;
+	struct myftp_list_reply page;
+	struct myftp_list_entry entry;
+	struct myftp_info info;
+	unsigned long long cursor = 0;
+	char request[12 + sizeof(list_request) + 256], *payload = NULL;
+	int len_of_request, len_of_payload, offset, len;
+
+	if (session == NULL || !session->authenticated) {
+		return MYFTP_ERR_STATE;
+	}
+	if (pattern == NULL) {
+		pattern = "";
+	}
+	len_of_request = 12 + sizeof(list_request) + snprintf(request + 12 + sizeof(list_request), 256, "%s", pattern) + 1;
+	if (len_of_request > (int)sizeof(request)) {
+		len_of_request = sizeof(request);
+	}
+	memset(&info, 0, sizeof(info));
+	do {
+		// send LIST_REQUEST for the next page
+		set_header(&LIST_REQUEST, 0xA5, MYFTP_PAGED, len_of_request);
+		list_request.cursor_hi = htonl((unsigned int)(cursor >> 32));
+		list_request.cursor_lo = htonl((unsigned int)cursor);
+		list_request.max_entries = htonl(LIST_PAGE_SIZE);
+		memcpy(request, &LIST_REQUEST, 12);
+		memcpy(request + 12, &list_request, sizeof(list_request));
+		send_packet(session->sd, request, len_of_request);
+
+		// wait and receive LIST_REPLY
+		if (!receive_reply(session, &LIST_REPLY, 0xA6) || LIST_REPLY.length < 12 + sizeof(page)) {
+			free(payload);
+			return broken(session);
+		}
+		len_of_payload = LIST_REPLY.length - 12;
+		payload = realloc(payload, len_of_payload);
+		if (receive_packet(session->sd, payload, len_of_payload) < len_of_payload) {
+			free(payload);
+			return broken(session);
+		}
+		memcpy(&page, payload, sizeof(page));
+		cursor = stat_field(page.cursor_hi, page.cursor_lo);
+
+		// hand over the entries of this page
+		offset = sizeof(page);
+		while (offset + (int)sizeof(entry) <= len_of_payload) {
+			memcpy(&entry, payload + offset, sizeof(entry));
+			len = ntohs(entry.name_length);
+			if (offset + (int)sizeof(entry) + len > len_of_payload || len > 255) {
+				break;
+			}
+			memcpy(info.name, payload + offset + sizeof(entry), len);
+			info.name[len] = '\0';
+			info.type = entry.type;
+			info.size = stat_field(entry.size_hi, entry.size_lo);
+			info.mtime = (time_t)stat_field(entry.mtime_hi, entry.mtime_lo);
+			callback(&info, arg);
+			offset += sizeof(entry) + len;
+		}
+	} while (LIST_REPLY.status == 1);
+	free(payload);
+
+	return MYFTP_OK;
+}
+
+int myftp_stat_file(myftp_session *session, const char *name, int want_hash, struct myftp_info *info)
+{
+	struct message_s STAT_REPLY;
+	struct myftp_stat ms;
+	char request[12 + 256];
+	int len_of_request;
+
+	if (session == NULL || !session->authenticated) {
+		return MYFTP_ERR_STATE;
+	}
+
+	// send STAT_REQUEST
+	len_of_request = 12 + snprintf(request + 12, 256, "%.255s", name) + 1;
+	set_header((struct message_s *)request, 0xAD, want_hash ? MYFTP_HASH : 0, len_of_request);
+	send_packet(session->sd, request, len_of_request);
+
+	// wait and receive STAT_REPLY
+	if (!receive_reply(session, &STAT_REPLY, 0xAE) || STAT_REPLY.length != 12 + (STAT_REPLY.status ? sizeof(ms) : 0)) {
+		return broken(session);
+	}
+	if (STAT_REPLY.status == 0) {
+		return MYFTP_ERR_NOT_FOUND;
+	}
+	if (receive_packet(session->sd, &ms, sizeof(ms)) < (int)sizeof(ms)) {
+		return broken(session);
+	}
+	memset(info, 0, sizeof(*info));
+	snprintf(info->name, sizeof(info->name), "%s", name);
+	info->type = 'f';
+	unpack_stat(info, &ms);
+
+	return MYFTP_OK;
+}
+
+int myftp_get(myftp_session *session, const char *remote, const char *local)
+{
+	struct message_s GET_REQUEST, GET_REPLY, FILE_DATA;
+	struct myftp_stat ms;
+	struct stat st;
+	struct utimbuf times;
+	char request[12 + 256 + sizeof(struct myftp_stat)];
+	int len_of_request, len_of_reply, have_stat, fd, saved = 0;
+	long long len_of_payload, received;
+
+	if (session == NULL || !session->authenticated) {
+		return MYFTP_ERR_STATE;
+	}
+	if (local == NULL) {
+		local = remote;
+	}
+
+	// we take sparse FILE_DATA and small files inline
+	len_of_request = 12 + snprintf(request + 12, 256, "%.255s", remote) + 1;
+	set_header(&GET_REQUEST, 0xA7, MYFTP_SPARSE | MYFTP_INLINE, 0);
+	if (stat(local, &st) == 0 && S_ISREG(st.st_mode)) {
+		// only send the file if it differs from our copy
+		GET_REQUEST.status |= MYFTP_CONDITIONAL;
+		memset(&ms, 0, sizeof(ms));
+		ms.size_hi = htonl((unsigned int)((unsigned long long)st.st_size >> 32));
+		ms.size_lo = htonl((unsigned int)st.st_size);
+		ms.mtime_hi = htonl((unsigned int)((unsigned long long)st.st_mtime >> 32));
+		ms.mtime_lo = htonl((unsigned int)st.st_mtime);
+		memcpy(request + len_of_request, &ms, sizeof(ms));
+		len_of_request += sizeof(ms);
+	}
+	GET_REQUEST.length = htonl(len_of_request);
+	memcpy(request, &GET_REQUEST, 12);
+	send_packet(session->sd, request, len_of_request);
+
+	// wait and receive GET_REPLY
+	if (!receive_reply(session, &GET_REPLY, 0xA8)) {
+		return broken(session);
+	}
+	len_of_reply = GET_REPLY.length;
+	if (len_of_reply != 12 && len_of_reply < 12 + sizeof(ms)) {
+		return broken(session);
+	}
+	if (GET_REPLY.status == MYFTP_NOT_FOUND) {
+		return MYFTP_ERR_NOT_FOUND;
+	}
+	have_stat = len_of_reply >= 12 + sizeof(ms);
+	if (have_stat && receive_packet(session->sd, &ms, sizeof(ms)) < (int)sizeof(ms)) {
+		return broken(session);
+	}
+	if (GET_REPLY.status == MYFTP_NOT_MODIFIED) {
+		return MYFTP_UNCHANGED;
+	}
+
+	if (GET_REPLY.status == MYFTP_INLINED) {
+		// the file came with GET_REPLY
+		FILE_DATA.status = 0;
+		len_of_payload = len_of_reply - 12 - sizeof(ms);
+	} else {
+		// wait and receive FILE_DATA
+		if (!receive_reply(session, &FILE_DATA, 0xFF)) {
+			return broken(session);
+		}
+		len_of_payload = (unsigned int)FILE_DATA.length - 12;
+	}
+
+	// stream the file to disk, still draining it if the file cannot be created
+	if ((fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		saved = errno;
+	}
+	if (FILE_DATA.status & MYFTP_SPARSE) {
+		received = len_of_payload = pipe_receive_sparse(session->sd, fd);
+	} else {
+		received = pipe_receive_file(session->sd, fd, len_of_payload);
+	}
+	if (fd >= 0) {
+		if (received < 0) {
+			saved = errno;
+		}
+		close(fd);
+	}
+	if (received == PIPE_BROKEN || (received >= 0 && received < len_of_payload)) {
+		return broken(session);
+	}
+	if (fd < 0 || received < 0) {
+		errno = saved;
+		return MYFTP_ERR_LOCAL;
+	}
+	if (have_stat) {
+		// take the server's mtime, so the next get of this file can be conditional
+		times.actime = time(NULL);
+		times.modtime = (time_t)stat_field(ms.mtime_hi, ms.mtime_lo);
+		utime(local, &times);
+	}
+
+	return MYFTP_OK;
+}
+
+int myftp_put(myftp_session *session, const char *local, const char *remote)
+{
+	struct message_s PUT_REPLY, FILE_DATA;
+	struct stat st;
+	char request[12 + 256];
+	int len_of_request, fd, saved;
+	long long len_of_payload;
+
+	if (session == NULL || !session->authenticated) {
+		return MYFTP_ERR_STATE;
+	}
+	if (remote == NULL) {
+		remote = local;
+	}
+	if ((fd = open(local, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		saved = errno;
+		if (fd >= 0) {
+			close(fd);
+		}
+		errno = saved;
+		return MYFTP_ERR_LOCAL;
+	}
+
+	// send PUT_REQUEST
+	len_of_request = 12 + snprintf(request + 12, 256, "%.255s", remote) + 1;
+	set_header((struct message_s *)request, 0xA9, 0, len_of_request);
+	send_packet(session->sd, request, len_of_request);
+
+	// wait and receive PUT_REPLY
+	if (!receive_reply(session, &PUT_REPLY, 0xAA) || PUT_REPLY.length != 12) {
+		close(fd);
+		return broken(session);
+	}
+
+	// send FILE_DATA
+	len_of_payload = (long long)st.st_size;
+	if (PUT_REPLY.status & MYFTP_SPARSE) {
+		set_header(&FILE_DATA, 0xFF, MYFTP_SPARSE, 12);
+		send_packet(session->sd, &FILE_DATA, 12);
+		if (pipe_send_sparse(session->sd, fd, len_of_payload) < 0) {
+			close(fd);
+			return broken(session);
+		}
+	} else if (len_of_payload > MYFTP_MAX_BODY) {
+		// the header cannot describe it, and the server is waiting for FILE_DATA
+		close(fd);
+		broken(session);
+		errno = EFBIG;
+		return MYFTP_ERR_LOCAL;
+	} else {
+		set_header(&FILE_DATA, 0xFF, 0, 12 + len_of_payload);
+		send_packet(session->sd, &FILE_DATA, 12);
+		if (pipe_send_file(session->sd, fd, len_of_payload) < len_of_payload) {
+			close(fd);
+			return broken(session);
+		}
+	}
+	close(fd);
+
+	return MYFTP_OK;
+}
+
+int myftp_quit(myftp_session *session)
+{
+	struct message_s QUIT_REQUEST, QUIT_REPLY;
+	int result = MYFTP_OK;
+
+	if (session == NULL) {
+		return MYFTP_ERR_STATE;
+	}
+	if (session->sd >= 0) {
+		// send QUIT_REQUEST and wait for QUIT_REPLY
+		set_header(&QUIT_REQUEST, 0xAB, 0, 12);
+		send_packet(session->sd, &QUIT_REQUEST, 12);
+		if (!receive_reply(session, &QUIT_REPLY, 0xAC) || QUIT_REPLY.length != 12) {
+			result = MYFTP_ERR_PROTOCOL;
+		}
+	}
+	myftp_close(session);
+	return result;
+}
+
+void myftp_close(myftp_session *session)
+{
+	if (session != NULL) {
+		if (session->sd >= 0) {
+			close(session->sd);
+		}
+		free(session);
+	}
+	return;
+}
+
+myftp_pool *myftp_pool_create(const char *ip, int port, const char *user, const char *password, int max_sessions)
+{
+	myftp_pool *pool = (myftp_pool *)calloc(1, sizeof(myftp_pool));
+
+	snprintf(pool->ip, sizeof(pool->ip), "%s", ip);
+	snprintf(pool->user, sizeof(pool->user), "%s", user);
+	snprintf(pool->password, sizeof(pool->password), "%s", password);
+	pool->port = port;
+	pool->max_sessions = max_sessions > 0 ? max_sessions : 1;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->changed, NULL);
+	return pool;
+}
+
+// An idle session the server has since closed (e.g. while restarting) reads as ready
+static int still_open(myftp_session *session)
+{
+	struct pollfd pfd;
+
+	pfd.fd = session->sd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) == 0;
+}
+
+myftp_session *myftp_pool_acquire(myftp_pool *pool, int *result)
+{
+	myftp_session *session;
+	struct myftp_token token;
+	int has_token;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		if ((session = pool->idle) != NULL) {
+			pool->idle = session->next;
+			if (still_open(session)) {
+				pthread_mutex_unlock(&pool->lock);
+				*result = MYFTP_OK;
+				return session;
+			}
+			myftp_close(session);
+			pool->open_sessions--;
+			continue;
+		}
+		if (pool->open_sessions < pool->max_sessions) {
+			break;
+		}
+		pthread_cond_wait(&pool->changed, &pool->lock);
+	}
+
+	// Connect outside the lock, holding a place for the new session
+	has_token = pool->has_token;
+	token = pool->token;
+	pool->open_sessions++;
+	pthread_mutex_unlock(&pool->lock);
+	if (has_token) {
+		session = myftp_resume(pool->ip, pool->port, &token, pool->user, pool->password, result);
+	} else {
+		session = myftp_connect(pool->ip, pool->port, pool->user, pool->password, result);
+	}
+	pthread_mutex_lock(&pool->lock);
+	if (session == NULL) {
+		pool->open_sessions--;
+		pthread_cond_broadcast(&pool->changed);
+	} else if (session->has_token) {
+		pool->token = session->token;
+		pool->has_token = 1;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return session;
+}
+
+void myftp_pool_release(myftp_pool *pool, myftp_session *session)
+{
+	pthread_mutex_lock(&pool->lock);
+	if (session->sd >= 0 && session->authenticated) {
+		session->next = pool->idle;
+		pool->idle = session;
+	} else {
+		myftp_close(session);
+		pool->open_sessions--;
+	}
+	pthread_cond_broadcast(&pool->changed);
+	pthread_mutex_unlock(&pool->lock);
+	return;
+}
+
+static int pool_transfer(myftp_pool *pool, int upload, const char *remote, const char *local)
+{
+	myftp_session *session;
+	int result;
+
+	if ((session = myftp_pool_acquire(pool, &result)) == NULL) {
+		return result;
+	}
+	result = upload ? myftp_put(session, local, remote) : myftp_get(session, remote, local);
+	myftp_pool_release(pool, session);
+	return result;
+}
+
+int myftp_pool_get(myftp_pool *pool, const char *remote, const char *local)
+{
+	return pool_transfer(pool, 0, remote, local);
+}
+
+int myftp_pool_put(myftp_pool *pool, const char *local, const char *remote)
+{
+	return pool_transfer(pool, 1, remote, local);
+}
+
+static void *pool_thread(void *args)
+{
+	myftp_pool *pool = (myftp_pool *)args;
+	struct myftp_job *job;
+	int result;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		if ((job = pool->head) == NULL) {
+			if (pool->stopping) {
+				break;
+			}
+			pthread_cond_wait(&pool->changed, &pool->lock);
+			continue;
+		}
+		if ((pool->head = job->next) == NULL) {
+			pool->tail = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		result = pool_transfer(pool, job->upload, job->remote, job->local);
+		if (job->callback != NULL) {
+			job->callback(result, job->arg);
+		}
+		free(job->remote);
+		free(job->local);
+		free(job);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->pending--;
+		pthread_cond_broadcast(&pool->changed);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static int queue_job(myftp_pool *pool, int upload, const char *remote, const char *local, myftp_callback callback, void *arg)
+{
+	struct myftp_job *job = (struct myftp_job *)calloc(1, sizeof(struct myftp_job));
+
+	job->upload = upload;
+	job->remote = remote ? strdup(remote) : NULL;
+	job->local = local ? strdup(local) : NULL;
+	job->callback = callback;
+	job->arg = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail) {
+		pool->tail->next = job;
+	} else {
+		pool->head = job;
+	}
+	pool->tail = job;
+	pool->pending++;
+
+	// One thread per session at most, started as the queue needs them
+	if (pool->thread_count < pool->max_sessions && pool->thread_count < pool->pending) {
+		if (pool->threads == NULL) {
+			pool->threads = (pthread_t *)calloc(pool->max_sessions, sizeof(pthread_t));
+		}
+		if (pthread_create(&pool->threads[pool->thread_count], NULL, pool_thread, pool) == 0) {
+			pool->thread_count++;
+		}
+	}
+	pthread_cond_broadcast(&pool->changed);
+	pthread_mutex_unlock(&pool->lock);
+	return MYFTP_OK;
+}
+
+int myftp_get_async(myftp_pool *pool, const char *remote, const char *local, myftp_callback callback, void *arg)
+{
+	return queue_job(pool, 0, remote, local, callback, arg);
+}
+
+int myftp_put_async(myftp_pool *pool, const char *local, const char *remote, myftp_callback callback, void *arg)
+{
+	return queue_job(pool, 1, remote, local, callback, arg);
+}
+
+void myftp_pool_wait(myftp_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0) {
+		pthread_cond_wait(&pool->changed, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return;
+}
+
+void myftp_pool_destroy(myftp_pool *pool)
+{
+	myftp_session *session;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->changed);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->thread_count; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	while ((session = pool->idle) != NULL) {
+		pool->idle = session->next;
+		myftp_quit(session);
+	}
+	free(pool->threads);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->changed);
+	free(pool);
+	return;
+}
@@ -0,0 +1,93 @@
+#ifndef __LIBMYFTP__
+
+#define __LIBMYFTP__
+
+/*
+ Client library for the myftp protocol, built as libmyftp.a.
+
+ A myftp_session is one connection to a server. Its calls block and must
+ not be made from two threads at once. A myftp_pool keeps authenticated
+ sessions to one server and hands them out again, so repeated calls skip
+ the connection setup; new sessions log in with the newest resumption
+ token the pool was given. Its *_async calls run on the pool's own
+ threads and report through a callback. Nothing is printed, every call
+ returns one of the codes below.
+ */
+
+#include <time.h>
+#include "myftp.h"
+
+#define MYFTP_OK 0
+#define MYFTP_UNCHANGED 1	/* myftp_get(): the local copy is already current */
+#define MYFTP_ERR_ADDRESS -1	/* invalid IP address or port */
+#define MYFTP_ERR_CONNECT -2	/* connect() failed, see errno */
+#define MYFTP_ERR_REFUSED -3	/* the server refused the connection */
+#define MYFTP_ERR_PROTOCOL -4	/* unexpected data, the session is closed */
+#define MYFTP_ERR_AUTH -5	/* wrong user or password, the session is closed */
+#define MYFTP_ERR_STATE -6	/* the session is closed or not logged in */
+#define MYFTP_ERR_NOT_FOUND -7	/* no such file on the server */
+#define MYFTP_ERR_LOCAL -8	/* the local file cannot be read or written, see errno */
+
+typedef struct myftp_session myftp_session;
+typedef struct myftp_pool myftp_pool;
+
+struct myftp_info {
+	char name[256];
+	char type;	/* 'f' file, 'd' directory, '?' other */
+	unsigned long long size;
+	time_t mtime;
+	unsigned long long hash;	/* content hash, myftp_stat_file() with want_hash only */
+};
+
+typedef void (*myftp_list_callback)(const struct myftp_info *info, void *arg);
+typedef void (*myftp_callback)(int result, void *arg);
+
+const char *myftp_strerror(int result);
+
+/* Sessions */
+myftp_session *myftp_open(const char *ip, int port, int *result);
+int myftp_auth(myftp_session *session, const char *user, const char *password);
+int myftp_logged_in(const myftp_session *session);
+
+/* Open and log in within one round trip */
+myftp_session *myftp_connect(const char *ip, int port, const char *user, const char *password, int *result);
+
+/* Log in with a token from myftp_get_token() instead of the password, also
+ one round trip. If the server no longer takes the token, user and password
+ (unless NULL) are used instead. */
+myftp_session *myftp_resume(const char *ip, int port, const struct myftp_token *token, const char *user, const char *password, int *result);
+int myftp_get_token(const myftp_session *session, struct myftp_token *token);
+
+int myftp_list(myftp_session *session, const char *pattern, myftp_list_callback callback, void *arg);
+
+/* The server reads the whole file to hash it, so ask for that only if needed */
+int myftp_stat_file(myftp_session *session, const char *name, int want_hash, struct myftp_info *info);
+
+/* Download to local, skipped with MYFTP_UNCHANGED if local matches the server */
+int myftp_get(myftp_session *session, const char *remote, const char *local);
+
+/* Upload local as remote (local if NULL) */
+int myftp_put(myftp_session *session, const char *local, const char *remote);
+
+/* Log out and free the session, myftp_close() just drops the connection */
+int myftp_quit(myftp_session *session);
+void myftp_close(myftp_session *session);
+
+/* Pools, at most max_sessions connections are open at once */
+myftp_pool *myftp_pool_create(const char *ip, int port, const char *user, const char *password, int max_sessions);
+myftp_session *myftp_pool_acquire(myftp_pool *pool, int *result);
+void myftp_pool_release(myftp_pool *pool, myftp_session *session);
+int myftp_pool_get(myftp_pool *pool, const char *remote, const char *local);
+int myftp_pool_put(myftp_pool *pool, const char *local, const char *remote);
+
+/* Queue a transfer, the callback runs on a pool thread when it is done */
+int myftp_get_async(myftp_pool *pool, const char *remote, const char *local, myftp_callback callback, void *arg);
+int myftp_put_async(myftp_pool *pool, const char *local, const char *remote, myftp_callback callback, void *arg);
+
+/* Wait for every queued transfer */
+void myftp_pool_wait(myftp_pool *pool);
+
+/* Finish the queued transfers, log out and free the pool */
+void myftp_pool_destroy(myftp_pool *pool);
+
+#endif
@@ -9,4 +9,84 @@ struct message_s {
 	int length;	/* length (header + payload) (4 bytes) */
 } __attribute__ ((packed));
 
+/* status flag: in GET_REQUEST/PUT_REPLY the sender of the request/reply
+ accepts sparse FILE_DATA, in FILE_DATA the body is an extent stream */
+#define MYFTP_SPARSE 0x01
+
+/* largest body a plain FILE_DATA can carry, its length is 32 bits;
+ bigger files can only be sent as sparse FILE_DATA */
+#define MYFTP_MAX_BODY (0xffffffffLL - 12)
+
+/* GET_REQUEST status flags, together with MYFTP_SPARSE */
+#define MYFTP_CONDITIONAL 0x02	/* a myftp_stat of the client's copy follows the file name */
+#define MYFTP_INLINE 0x04	/* GET_REPLY carries a myftp_stat, and small files inline */
+
+/* STAT_REQUEST status flag */
+#define MYFTP_HASH 0x08	/* fill in the content hash of the STAT_REPLY */
+
+/* GET_REPLY status */
+#define MYFTP_NOT_FOUND 0
+#define MYFTP_FOUND 1	/* FILE_DATA follows */
+#define MYFTP_NOT_MODIFIED 2	/* the conditional GET matched, no FILE_DATA */
+#define MYFTP_INLINED 3	/* the file follows the myftp_stat in GET_REPLY */
+
+/* LIST_REQUEST status flag */
+#define MYFTP_PAGED 0x10	/* a myftp_list_request follows, LIST_REPLY is one page of entries */
+
+/* Payload of a MYFTP_PAGED LIST_REQUEST, followed by a NUL terminated glob
+ pattern (empty matches every file). All fields are big-endian. */
+struct myftp_list_request {
+	unsigned int cursor_hi;	/* 0 for the first page, then the cursor of the last reply (8 bytes) */
+	unsigned int cursor_lo;
+	unsigned int max_entries;	/* page size, capped by the server (4 bytes) */
+} __attribute__ ((packed));
+
+/* A MYFTP_PAGED LIST_REPLY has status 1 if more pages follow and 0 on the
+ last one. Its payload is a myftp_list_reply, then a myftp_list_entry and
+ name_length bytes of name for every file in the page. */
+struct myftp_list_reply {
+	unsigned int cursor_hi;	/* cursor of the next page (8 bytes) */
+	unsigned int cursor_lo;
+} __attribute__ ((packed));
+
+struct myftp_list_entry {
+	unsigned int size_hi;	/* file size in bytes (8 bytes) */
+	unsigned int size_lo;
+	unsigned int mtime_hi;	/* modification time, seconds since the epoch (8 bytes) */
+	unsigned int mtime_lo;
+	char type;	/* 'f' file, 'd' directory, '?' anything else (1 byte) */
+	unsigned short name_length;	/* length of the name that follows (2 bytes) */
+} __attribute__ ((packed));
+
+/* OPEN_CONN_REQUEST status flags, for logging in within the same round trip */
+#define MYFTP_WITH_AUTH 0x20	/* the payload is "user password", as in AUTH_REQUEST */
+#define MYFTP_RESUME 0x40	/* the payload is a myftp_token from an earlier session */
+
+/* In AUTH_REQUEST, MYFTP_RESUME asks for a myftp_token after the AUTH_REPLY
+ header. OPEN_CONN_REPLY has status 1 if the connection is open but not
+ logged in (the client may still send AUTH_REQUEST), or MYFTP_LOGGED_IN
+ followed by a myftp_token for the next connection. Either reply carries
+ no token if the server does not issue them. */
+#define MYFTP_LOGGED_IN 0x03
+
+/* Session resumption token, opaque to clients. All fields are big-endian. */
+struct myftp_token {
+	unsigned int expiry_hi;	/* seconds since the epoch (8 bytes) */
+	unsigned int expiry_lo;
+	char user[40];	/* NUL padded (40 bytes) */
+	unsigned int mac_hi;	/* SipHash-2-4 keyed by the server (8 bytes) */
+	unsigned int mac_lo;
+} __attribute__ ((packed));
+
+/* Payload of STAT_REPLY (0xAE), of MYFTP_INLINE GET_REPLYs and of
+ MYFTP_CONDITIONAL GET_REQUESTs. All fields are big-endian. */
+struct myftp_stat {
+	unsigned int size_hi;	/* file size in bytes (8 bytes) */
+	unsigned int size_lo;
+	unsigned int mtime_hi;	/* modification time, seconds since the epoch (8 bytes) */
+	unsigned int mtime_lo;
+	unsigned int hash_hi;	/* FNV-1a 64 of the content, 0 if not computed (8 bytes) */
+	unsigned int hash_lo;
+} __attribute__ ((packed));
+
 #endif
@@ -0,0 +1,284 @@
+/*
+ 
+ Simple FTP
+ 
+ Version: 1.0
+ GitHub repository: https://github.com/fortesit/simple-ftp
+ Author: Sit King Lok
+ Last modified: 2014-09-30 22:11
+ 
+ Description:
+ Asynchronous per-thread ring buffer logger, see myftplog.h
+ 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "myftplog.h"
+
+#define LOG_BATCH_MAX 4096
+#define LOG_IDLE_SLEEP 5000     /* microseconds between polls of idle rings */
+
+struct log_record
+{
+    unsigned long long time;    /* microseconds since the epoch */
+    int level;
+    int length;
+    char text[LOG_LINE_MAX];
+};
+
+// Single producer (the owning thread), single consumer (the flusher)
+struct log_ring
+{
+    struct log_record records[LOG_RING_SLOTS];
+    unsigned int head;          /* next slot to fill, written by the owner */
+    unsigned int tail;          /* next slot to drain, written by the flusher */
+    int in_use;                 /* claimed by a live thread */
+    unsigned long dropped;      /* written by the owner */
+    unsigned long reported;     /* written by the flusher */
+    unsigned long long window;  /* second the rate limit is counting */
+    int window_count;
+    struct log_ring *next;      /* rings are only ever added to the list */
+};
+
+volatile int log_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+static struct log_ring *rings = NULL;
+static __thread struct log_ring *my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_t flusher;
+static volatile bool started = false, stopping = false;
+static volatile int rate_limit = 0;
+
+static unsigned long long now_micros(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int format_record(char *buffer, struct log_record *record)
+{
+    time_t seconds = (time_t)(record->time / 1000000);
+    struct tm tm;
+    int len;
+    
+    localtime_r(&seconds, &tm);
+    len = (int)strftime(buffer, 32, "%Y-%m-%d %H:%M:%S", &tm);
+    len += sprintf(buffer + len, ".%06u %-5s ", (unsigned int)(record->time % 1000000), level_names[record->level]);
+    memcpy(buffer + len, record->text, record->length);
+    len += record->length;
+    buffer[len++] = '\n';
+    return len;
+}
+
+static void write_all(const char *buffer, int length)
+{
+    int written = 0, len;
+    while (written < length && (len = (int)write(STDOUT_FILENO, buffer + written, length - written)) > 0) {
+        written += len;
+    }
+}
+
+// Thread exit: hand the ring back, the flusher still drains what is left
+static void release_ring(void *ring)
+{
+    __atomic_store_n(&((struct log_ring*)ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static struct log_ring *claim_ring(void)
+{
+    struct log_ring *ring;
+    int unused = 0;
+    
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        if (__atomic_compare_exchange_n(&ring->in_use, &unused, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+        unused = 0;
+    }
+    if (ring == NULL) {
+        ring = (struct log_ring*)calloc(1, sizeof(struct log_ring));
+        ring->in_use = 1;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+void log_write(int level, const char *format, ...)
+{
+    struct log_ring *ring;
+    struct log_record *record, local;
+    unsigned int head;
+    va_list args;
+    
+    if (level < LOG_LEVEL_ERROR || level > LOG_LEVEL_DEBUG) {
+        level = LOG_LEVEL_DEBUG;
+    }
+    if (!started) {
+        // No flusher, write it out ourselves
+        char line[LOG_LINE_MAX + 64];
+        record = &local;
+        record->time = now_micros();
+        record->level = level;
+        va_start(args, format);
+        record->length = vsnprintf(record->text, LOG_LINE_MAX, format, args);
+        va_end(args);
+        if (record->length >= LOG_LINE_MAX) {
+            record->length = LOG_LINE_MAX - 1;
+        }
+        write_all(line, format_record(line, record));
+        return;
+    }
+    
+    if ((ring = my_ring) == NULL) {
+        ring = my_ring = claim_ring();
+    }
+    if (rate_limit > 0 && level != LOG_LEVEL_ERROR) {
+        unsigned long long second = now_micros() / 1000000;
+        if (second != ring->window) {
+            ring->window = second;
+            ring->window_count = 0;
+        }
+        if (ring->window_count++ >= rate_limit) {
+            __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    record = &ring->records[head % LOG_RING_SLOTS];
+    record->time = now_micros();
+    record->level = level;
+    va_start(args, format);
+    record->length = vsnprintf(record->text, LOG_LINE_MAX, format, args);
+    va_end(args);
+    if (record->length >= LOG_LINE_MAX) {
+        record->length = LOG_LINE_MAX - 1;
+    }
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    const struct log_record *x = *(struct log_record* const*)a, *y = *(struct log_record* const*)b;
+    return x->time < y->time ? -1 : x->time > y->time;
+}
+
+// Drain every ring once, returns the number of records written
+static int drain(struct log_record **batch, char *buffer)
+{
+    struct log_ring *ring;
+    struct log_record notice;
+    unsigned int head[64], slot;
+    struct log_ring *owner[64];
+    int i, n = 0, rings_seen = 0, used = 0, total = 0;
+    unsigned long dropped;
+    
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        // Collect a batch from up to 64 rings, then sort and write it
+        head[rings_seen] = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        owner[rings_seen] = ring;
+        for (slot = ring->tail; slot != head[rings_seen] && n < LOG_BATCH_MAX; slot++) {
+            batch[n++] = &ring->records[slot % LOG_RING_SLOTS];
+        }
+        head[rings_seen] = slot;
+        dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported) {
+            notice.time = now_micros();
+            notice.level = LOG_LEVEL_WARN;
+            notice.length = snprintf(notice.text, LOG_LINE_MAX, "Dropped %lu log messages", dropped - ring->reported);
+            used += format_record(buffer + used, &notice);
+            ring->reported = dropped;
+        }
+        rings_seen++;
+        if (rings_seen == 64 || n == LOG_BATCH_MAX || ring->next == NULL) {
+            qsort(batch, n, sizeof(struct log_record*), compare_records);
+            for (i = 0; i < n; i++) {
+                used += format_record(buffer + used, batch[i]);
+                if (used > LOG_BATCH_MAX * 64) {
+                    write_all(buffer, used);
+                    used = 0;
+                }
+            }
+            write_all(buffer, used);
+            // Only now hand the slots back to their owners
+            for (i = 0; i < rings_seen; i++) {
+                __atomic_store_n(&owner[i]->tail, head[i], __ATOMIC_RELEASE);
+            }
+            total += n;
+            n = rings_seen = used = 0;
+        }
+    }
+    return total;
+}
+
+static void *flush_loop(void *args)
+{
+    struct log_record **batch = (struct log_record**)malloc(LOG_BATCH_MAX * sizeof(struct log_record*));
+    char *buffer = (char*)malloc(LOG_BATCH_MAX * 64 + LOG_LINE_MAX + 64 * (LOG_LINE_MAX + 64) + 128);
+    
+    while (!stopping) {
+        if (drain(batch, buffer) == 0) {
+            usleep(LOG_IDLE_SLEEP);
+        }
+    }
+    while (drain(batch, buffer) > 0);
+    free(batch);
+    free(buffer);
+    return NULL;
+}
+
+void log_start(int rate)
+{
+    if (started) {
+        return;
+    }
+    rate_limit = rate;
+    pthread_key_create(&ring_key, release_ring);
+    stopping = false;
+    if (pthread_create(&flusher, NULL, flush_loop, NULL) != 0) {
+        // Stay synchronous
+        return;
+    }
+    started = true;
+    atexit(log_stop);
+}
+
+void log_set_rate(int rate)
+{
+    rate_limit = rate;
+}
+
+void log_stop(void)
+{
+    if (!started || stopping) {
+        return;
+    }
+    stopping = true;
+    pthread_join(flusher, NULL);
+}
+
+int log_parse_level(const char *name)
+{
+    int i;
+    for (i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++) {
+        if (!strcasecmp(name, level_names[i]) || (name[0] == '0' + i && name[1] == '\0')) {
+            return i;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,45 @@
+#ifndef __MYFTPLOG__
+
+#define __MYFTPLOG__
+
+/*
+ Asynchronous logger used by the server.
+ 
+ Every thread formats its messages into its own lock-free ring of
+ LOG_RING_SLOTS records; a background thread drains the rings, orders the
+ records by time and writes them to stdout in batches. Messages above the
+ current level cost one comparison, a full ring or a thread going over
+ the rate limit drops messages (errors are never rate limited) and the
+ flusher reports how many were dropped. Until log_start() is called, and
+ in processes that never call it, messages are written synchronously.
+ Since errors bypass the rate limit, LOG_LEVEL_ERROR is kept for faults of
+ the server itself; anything a client can cause is logged as a warning.
+ */
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#define LOG_RING_SLOTS 256
+#define LOG_LINE_MAX 240
+
+extern volatile int log_level;
+
+#define LOG(level, ...) do { if ((level) <= log_level) log_write((level), __VA_ARGS__); } while (0)
+
+/* Start the flusher thread; rate is the per-thread limit in messages per second, 0 for none */
+void log_start(int rate);
+
+/* Change the per-thread rate limit of a running logger */
+void log_set_rate(int rate);
+
+/* Flush everything and stop the flusher thread, also run at exit */
+void log_stop(void);
+
+/* Parse "error", "warn", "info", "debug" or 0-3, -1 if invalid */
+int log_parse_level(const char *name);
+
+void log_write(int level, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+#endif
@@ -0,0 +1,566 @@
+/*
+ 
+ Simple FTP
+ 
+ Version: 1.0
+ GitHub repository: https://github.com/fortesit/simple-ftp
+ Author: Sit King Lok
+ Last modified: 2014-09-30 22:11
+ 
+ Description:
+ Double-buffered disk/network transfer pipeline, see myftppipe.h
+ 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "myftppipe.h"
+
+#define PIPE_SLOT_SIZE (PIPE_CHUNK_SIZE + 4 * sizeof(struct pipe_extent))
+
+struct ring
+{
+    char *buffer[PIPE_RING_SLOTS];
+    int length[PIPE_RING_SLOTS];
+    long long offset[PIPE_RING_SLOTS];  /* file offset of each buffer */
+    int head, tail, count;
+    bool done;      /* producer has nothing more to add */
+    int fd;
+    long long remaining;
+    long long transferred;
+    void *state;    /* producer state, e.g. the sparse encoder */
+    bool failed;
+    int error;      /* errno of the disk access that failed, it may have been on another thread */
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty, not_full;
+};
+
+// Where the sparse encoder is in the file
+struct sparse
+{
+    int fd;
+    long long size;
+    long long offset;
+    long long data_end;     /* end of the data region offset is in */
+    long long hole;         /* zero bytes not yet sent as a HOLE extent */
+    bool finished;
+};
+
+static int send_all(int sd, const char *buffer, int length)
+{
+    int sentLength = 0;
+    while (sentLength < length) {
+        int len = (int)send(sd, buffer + sentLength, length - sentLength, PIPE_SEND_FLAGS);
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        sentLength += len;
+    }
+    return sentLength;
+}
+
+static int receive_all(int sd, char *buffer, int length)
+{
+    int receivedLength = 0;
+    while (receivedLength < length) {
+        int len = (int)recv(sd, buffer + receivedLength, length - receivedLength, 0);
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        receivedLength += len;
+    }
+    return receivedLength;
+}
+
+// Fill buffer from fd, zero-filling whatever cannot be read
+static bool read_chunk(int fd, char *buffer, int length)
+{
+    int readLength = 0;
+    while (readLength < length) {
+        int len = (int)read(fd, buffer + readLength, length - readLength);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            // An error, or the file is shorter than expected
+            memset(buffer + readLength, 0, length - readLength);
+            return false;
+        }
+        readLength += len;
+    }
+    return true;
+}
+
+static bool write_chunk(int fd, const char *buffer, int length, long long offset)
+{
+    int writtenLength = 0;
+    while (writtenLength < length) {
+        int len = (int)pwrite(fd, buffer + writtenLength, length - writtenLength, offset + writtenLength);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            return false;
+        }
+        writtenLength += len;
+    }
+    return true;
+}
+
+static void ring_init(struct ring *r, int fd, long long length)
+{
+    memset(r, 0, sizeof(*r));
+    // The other buffers are allocated once the ring is actually used
+    r->buffer[0] = (char*)malloc(PIPE_SLOT_SIZE);
+    r->fd = fd;
+    r->remaining = length;
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->not_empty, NULL);
+    pthread_cond_init(&r->not_full, NULL);
+}
+
+static void ring_destroy(struct ring *r)
+{
+    int i;
+    for (i = 0; i < PIPE_RING_SLOTS; i++) {
+        free(r->buffer[i]);
+    }
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->not_empty);
+    pthread_cond_destroy(&r->not_full);
+}
+
+// Producer side: wait for a free slot
+static char *ring_acquire_free(struct ring *r)
+{
+    char *buffer;
+    pthread_mutex_lock(&r->mutex);
+    while (r->count == PIPE_RING_SLOTS) {
+        pthread_cond_wait(&r->not_full, &r->mutex);
+    }
+    if (r->buffer[r->head] == NULL) {
+        r->buffer[r->head] = (char*)malloc(PIPE_SLOT_SIZE);
+    }
+    buffer = r->buffer[r->head];
+    pthread_mutex_unlock(&r->mutex);
+    return buffer;
+}
+
+static void ring_produce(struct ring *r, int length, long long offset)
+{
+    pthread_mutex_lock(&r->mutex);
+    r->length[r->head] = length;
+    r->offset[r->head] = offset;
+    r->head = (r->head + 1) % PIPE_RING_SLOTS;
+    r->count++;
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+static void ring_finish(struct ring *r)
+{
+    pthread_mutex_lock(&r->mutex);
+    r->done = true;
+    pthread_cond_signal(&r->not_empty);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+// Consumer side: wait for a filled slot, NULL once the producer is done
+static char *ring_acquire_full(struct ring *r, int *length)
+{
+    char *buffer = NULL;
+    pthread_mutex_lock(&r->mutex);
+    while (r->count == 0 && !r->done) {
+        pthread_cond_wait(&r->not_empty, &r->mutex);
+    }
+    if (r->count > 0) {
+        buffer = r->buffer[r->tail];
+        *length = r->length[r->tail];
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return buffer;
+}
+
+static void ring_consume(struct ring *r)
+{
+    pthread_mutex_lock(&r->mutex);
+    r->tail = (r->tail + 1) % PIPE_RING_SLOTS;
+    r->count--;
+    pthread_cond_signal(&r->not_full);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+static void *disk_reader(void *args)
+{
+    struct ring *r = (struct ring*)args;
+    while (r->remaining > 0) {
+        int len = r->remaining < PIPE_CHUNK_SIZE ? (int)r->remaining : PIPE_CHUNK_SIZE;
+        char *buffer = ring_acquire_free(r);
+        if (r->failed) {
+            // The slot still holds an earlier chunk, or nothing at all
+            memset(buffer, 0, len);
+        } else if (!read_chunk(r->fd, buffer, len)) {
+            r->failed = true;
+        }
+        ring_produce(r, len, 0);
+        r->remaining -= len;
+    }
+    ring_finish(r);
+    return NULL;
+}
+
+static void *disk_writer(void *args)
+{
+    struct ring *r = (struct ring*)args;
+    char *buffer;
+    int len;
+    while ((buffer = ring_acquire_full(r, &len)) != NULL) {
+        if (r->fd >= 0 && !r->failed && !write_chunk(r->fd, buffer, len, r->offset[r->tail])) {
+            // Keep draining the ring so the socket stays in sync
+            r->failed = true;
+            r->error = errno;
+        }
+        ring_consume(r);
+    }
+    return NULL;
+}
+
+long long pipe_send_file(int sd, int fd, long long length)
+{
+    struct ring r;
+    pthread_t reader;
+    char *buffer;
+    int len;
+    
+    if (length <= PIPE_CHUNK_SIZE) {
+        buffer = (char*)malloc(length > 0 ? length : 1);
+        read_chunk(fd, buffer, (int)length);
+        len = send_all(sd, buffer, (int)length);
+        free(buffer);
+        return len;
+    }
+    
+    ring_init(&r, fd, length);
+    if (pthread_create(&reader, NULL, disk_reader, &r) != 0) {
+        // No thread available, run the reader inline one chunk at a time
+        while (r.remaining > 0) {
+            len = r.remaining < PIPE_CHUNK_SIZE ? (int)r.remaining : PIPE_CHUNK_SIZE;
+            read_chunk(fd, r.buffer[0], len);
+            r.transferred += send_all(sd, r.buffer[0], len);
+            r.remaining -= len;
+        }
+        ring_destroy(&r);
+        return r.transferred;
+    }
+    while ((buffer = ring_acquire_full(&r, &len)) != NULL) {
+        r.transferred += send_all(sd, buffer, len);
+        ring_consume(&r);
+    }
+    pthread_join(reader, NULL);
+    ring_destroy(&r);
+    return r.transferred;
+}
+
+long long pipe_receive_file(int sd, int fd, long long length)
+{
+    struct ring r;
+    pthread_t writer;
+    char *buffer;
+    int len, received;
+    bool threaded;
+    
+    if (length <= PIPE_CHUNK_SIZE) {
+        buffer = (char*)malloc(length > 0 ? length : 1);
+        received = receive_all(sd, buffer, (int)length);
+        if (fd >= 0 && !write_chunk(fd, buffer, received, 0)) {
+            received = -1;
+        }
+        free(buffer);
+        return received;
+    }
+    
+    ring_init(&r, fd, length);
+    threaded = pthread_create(&writer, NULL, disk_writer, &r) == 0;
+    while (r.remaining > 0) {
+        len = r.remaining < PIPE_CHUNK_SIZE ? (int)r.remaining : PIPE_CHUNK_SIZE;
+        buffer = threaded ? ring_acquire_free(&r) : r.buffer[0];
+        received = receive_all(sd, buffer, len);
+        if (threaded) {
+            ring_produce(&r, received, r.transferred);
+        } else if (fd >= 0 && !r.failed && !write_chunk(fd, buffer, received, r.transferred)) {
+            r.failed = true;
+            r.error = errno;
+        }
+        r.transferred += received;
+        r.remaining -= len;
+        if (received < len) {
+            // The connection is gone, flush what we have and stop
+            r.remaining = 0;
+        }
+    }
+    if (threaded) {
+        ring_finish(&r);
+        pthread_join(writer, NULL);
+    }
+    ring_destroy(&r);
+    if (r.failed) {
+        errno = r.error;
+        return -1;
+    }
+    return r.transferred;
+}
+
+static int put_extent(char *buffer, char type, long long length)
+{
+    struct pipe_extent extent;
+    extent.type = type;
+    extent.length_hi = htonl((unsigned int)(length >> 32));
+    extent.length_lo = htonl((unsigned int)length);
+    memcpy(buffer, &extent, sizeof(extent));
+    return sizeof(extent);
+}
+
+static bool is_zero(const char *buffer, int length)
+{
+    return buffer[0] == 0 && memcmp(buffer, buffer + 1, length - 1) == 0;
+}
+
+// Find the next data region at or after sp->offset, counting what is skipped as hole
+static void seek_data(struct sparse *sp)
+{
+    long long data = -1, hole = -1;
+#ifdef SEEK_DATA
+    data = lseek(sp->fd, sp->offset, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+        // Nothing but a hole up to the end of the file
+        data = sp->size;
+    }
+#endif
+    if (data < sp->offset) {
+        // No hole support, everything is data
+        data = sp->offset;
+    }
+    if (data > sp->size) {
+        data = sp->size;
+    }
+    sp->hole += data - sp->offset;
+    sp->offset = data;
+#ifdef SEEK_HOLE
+    hole = lseek(sp->fd, data, SEEK_HOLE);
+#endif
+    sp->data_end = hole < data || hole > sp->size ? sp->size : hole;
+}
+
+/*
+ Encode the next part of the file as extents into buffer (PIPE_SLOT_SIZE
+ bytes). Returns the encoded length, 0 once the END extent has been sent.
+ The data is read in place after room for two extents and compacted towards
+ the front; every zero block dropped frees far more than the next extents
+ need, so the output never overtakes the input.
+ */
+static int encode_extents(struct sparse *sp, char *buffer)
+{
+    char *in = buffer + 2 * sizeof(struct pipe_extent);
+    int out = 0, pos, start, len, block;
+    
+    if (sp->finished) {
+        return 0;
+    }
+    while (out == 0 && sp->offset < sp->size) {
+        if (sp->offset >= sp->data_end) {
+            seek_data(sp);
+            continue;
+        }
+        len = sp->data_end - sp->offset < PIPE_CHUNK_SIZE ? (int)(sp->data_end - sp->offset) : PIPE_CHUNK_SIZE;
+        pos = (int)pread(sp->fd, in, len, sp->offset);
+        if (pos < len) {
+            // The file shrank under us, send zeros for the rest
+            memset(in + (pos > 0 ? pos : 0), 0, len - (pos > 0 ? pos : 0));
+        }
+        sp->offset += len;
+        
+        for (pos = 0; pos < len; ) {
+            block = len - pos < PIPE_BLOCK_SIZE ? len - pos : PIPE_BLOCK_SIZE;
+            if (is_zero(in + pos, block)) {
+                sp->hole += block;
+                pos += block;
+                continue;
+            }
+            for (start = pos; pos < len; pos += block) {
+                block = len - pos < PIPE_BLOCK_SIZE ? len - pos : PIPE_BLOCK_SIZE;
+                if (is_zero(in + pos, block)) {
+                    break;
+                }
+            }
+            if (sp->hole > 0) {
+                out += put_extent(buffer + out, PIPE_EXTENT_HOLE, sp->hole);
+                sp->hole = 0;
+            }
+            out += put_extent(buffer + out, PIPE_EXTENT_DATA, pos - start);
+            memmove(buffer + out, in + start, pos - start);
+            out += pos - start;
+        }
+    }
+    if (sp->offset >= sp->size) {
+        // A trailing hole is implied by the size in the END extent
+        out += put_extent(buffer + out, PIPE_EXTENT_END, sp->size);
+        sp->finished = true;
+    }
+    return out;
+}
+
+static void *sparse_reader(void *args)
+{
+    struct ring *r = (struct ring*)args;
+    struct sparse *sp = (struct sparse*)r->state;
+    int len;
+    do {
+        char *buffer = ring_acquire_free(r);
+        if ((len = encode_extents(sp, buffer)) > 0) {
+            ring_produce(r, len, 0);
+        }
+    } while (len > 0);
+    ring_finish(r);
+    return NULL;
+}
+
+long long pipe_send_sparse(int sd, int fd, long long length)
+{
+    struct ring r;
+    struct sparse sp;
+    pthread_t reader;
+    char *buffer;
+    int len;
+    
+    memset(&sp, 0, sizeof(sp));
+    sp.fd = fd;
+    sp.size = length;
+    ring_init(&r, fd, length);
+    r.state = &sp;
+    
+    // Encode the first slot inline, most files end right there
+    len = encode_extents(&sp, r.buffer[0]);
+    if (send_all(sd, r.buffer[0], len) < len) {
+        ring_destroy(&r);
+        return -1;
+    }
+    if (sp.finished) {
+        ring_destroy(&r);
+        return length;
+    }
+    
+    if (pthread_create(&reader, NULL, sparse_reader, &r) != 0) {
+        while ((len = encode_extents(&sp, r.buffer[0])) > 0) {
+            if (send_all(sd, r.buffer[0], len) < len) {
+                r.failed = true;
+                break;
+            }
+        }
+        ring_destroy(&r);
+        return r.failed ? -1 : length;
+    }
+    while ((buffer = ring_acquire_full(&r, &len)) != NULL) {
+        if (!r.failed && send_all(sd, buffer, len) < len) {
+            // Keep consuming so the reader can finish
+            r.failed = true;
+        }
+        ring_consume(&r);
+    }
+    pthread_join(reader, NULL);
+    ring_destroy(&r);
+    return r.failed ? -1 : length;
+}
+
+long long pipe_receive_sparse(int sd, int fd)
+{
+    struct ring r;
+    struct pipe_extent extent;
+    pthread_t writer;
+    char *buffer;
+    long long len, offset = 0, size = PIPE_BROKEN;
+    int extents = 0;
+    bool threaded = false;
+    
+    ring_init(&r, fd, 0);
+    while (receive_all(sd, (char*)&extent, sizeof(extent)) == sizeof(extent)) {
+        len = ((long long)ntohl(extent.length_hi) << 32) | ntohl(extent.length_lo);
+        if (extent.type == PIPE_EXTENT_END && len >= offset) {
+            size = len;
+            break;
+        }
+        if (extent.type == PIPE_EXTENT_HOLE && len >= 0) {
+            // Left unwritten, the file was truncated before we started
+            offset += len;
+            continue;
+        }
+        if (extent.type != PIPE_EXTENT_DATA || len <= 0 || len > PIPE_CHUNK_SIZE) {
+            // Malformed, size stays PIPE_BROKEN
+            break;
+        }
+        
+        // Write the first extent inline, start the writer once there is more
+        if (extents++ == 1) {
+            threaded = pthread_create(&writer, NULL, disk_writer, &r) == 0;
+        }
+        buffer = threaded ? ring_acquire_free(&r) : r.buffer[0];
+        if (receive_all(sd, buffer, (int)len) < len) {
+            break;
+        }
+        if (threaded) {
+            ring_produce(&r, (int)len, offset);
+        } else if (fd >= 0 && !r.failed && !write_chunk(fd, buffer, (int)len, offset)) {
+            r.failed = true;
+            r.error = errno;
+        }
+        offset += len;
+    }
+    if (threaded) {
+        ring_finish(&r);
+        pthread_join(writer, NULL);
+    }
+    ring_destroy(&r);
+    
+    // Recreate trailing holes
+    if (size >= 0 && fd >= 0 && !r.failed && ftruncate(fd, size) < 0) {
+        r.failed = true;
+        r.error = errno;
+    }
+    if (size >= 0 && r.failed) {
+        errno = r.error;
+        return -1;
+    }
+    return size;
+}
+
+unsigned long long pipe_hash_file(int fd)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    unsigned char *buffer = (unsigned char*)malloc(PIPE_CHUNK_SIZE);
+    long long offset = 0;
+    int i, len;
+    
+    while ((len = (int)pread(fd, buffer, PIPE_CHUNK_SIZE, offset)) > 0) {
+        for (i = 0; i < len; i++) {
+            h ^= buffer[i];
+            h *= 1099511628211ULL;
+        }
+        offset += len;
+    }
+    free(buffer);
+    // 0 means "no hash" on the wire
+    return h ? h : 1;
+}
@@ -0,0 +1,77 @@
+#ifndef __MYFTPPIPE__
+
+#define __MYFTPPIPE__
+
+/*
+ Transfer pipeline shared by the client and the server.
+ 
+ A file body is moved through a ring of PIPE_RING_SLOTS buffers of
+ PIPE_CHUNK_SIZE bytes. One side of the ring is served by a separate
+ disk I/O thread and the other by the calling thread on the socket, so
+ reading the file overlaps sending it and receiving overlaps writing.
+ Bodies that fit in one buffer are moved without starting a thread.
+ */
+
+#define PIPE_CHUNK_SIZE (256 * 1024)
+#define PIPE_RING_SLOTS 4
+
+/*
+ Nothing here prints: failures come back as short counts or -1, with errno
+ set to the cause where there is one. Sends use PIPE_SEND_FLAGS, so a peer
+ that has gone away is an EPIPE error rather than a SIGPIPE killing the
+ program; where MSG_NOSIGNAL is missing the socket needs SO_NOSIGPIPE.
+ */
+
+#include <sys/socket.h>
+
+#ifdef MSG_NOSIGNAL
+#define PIPE_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define PIPE_SEND_FLAGS 0
+#endif
+
+/*
+ Sparse FILE_DATA (status MYFTP_SPARSE) carries no length in its header.
+ It is followed by a stream of extents describing the file from offset 0:
+ DATA extents are followed by their bytes (at most PIPE_CHUNK_SIZE), HOLE
+ extents stand for that many zero bytes, and the END extent closes the
+ stream with the full file size. Holes are found with SEEK_DATA/SEEK_HOLE
+ and, as a fallback, by spotting all-zero PIPE_BLOCK_SIZE blocks.
+ */
+
+#define PIPE_BLOCK_SIZE 4096
+#define PIPE_EXTENT_DATA 0x01
+#define PIPE_EXTENT_HOLE 0x02
+#define PIPE_EXTENT_END 0x03
+
+struct pipe_extent {
+	char type;	/* PIPE_EXTENT_* (1 byte) */
+	unsigned int length_hi;	/* length, big-endian (8 bytes) */
+	unsigned int length_lo;
+} __attribute__ ((packed));
+
+/* pipe_receive_sparse() result when the extent stream is broken */
+#define PIPE_BROKEN -2
+
+/* Send length bytes read from fd to socket sd. Returns the number of bytes
+ sent; if fd runs short the rest is zero-filled so the peer stays in sync. */
+long long pipe_send_file(int sd, int fd, long long length);
+
+/* Receive length bytes from socket sd and write them to fd (discarded if fd
+ is negative). Returns the number of bytes received, or -1 with errno set if
+ a write failed. */
+long long pipe_receive_file(int sd, int fd, long long length);
+
+/* Send the length bytes of fd as a sparse extent stream. Returns the number
+ of file bytes covered, or -1 if the connection failed. */
+long long pipe_send_sparse(int sd, int fd, long long length);
+
+/* Receive a sparse extent stream into fd (discarded if fd is negative),
+ leaving holes unwritten. Returns the file size, -1 with errno set if a
+ write failed, or PIPE_BROKEN if the stream was cut short or malformed. */
+long long pipe_receive_sparse(int sd, int fd);
+
+/* FNV-1a 64 hash of the content of fd, never 0 */
+unsigned long long pipe_hash_file(int fd);
+
+#endif
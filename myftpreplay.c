@@ -0,0 +1,580 @@
+/*
+
+ Simple FTP
+
+ Version: 1.0
+ GitHub repository: https://github.com/fortesit/simple-ftp
+ Author: Sit King Lok
+ Last modified: 2014-09-30 22:11
+
+ Description:
+ Replays a session trace recorded by the server (-t TRACE) against a
+ test server, so server changes can be measured with a real traffic mix.
+ Every recorded session is opened again with its requests in order
+ (LIST, STAT and GET of the recorded name, PUT of the recorded size), either at
+ the recorded pace or as fast as possible, with many sessions at once.
+ GET and STAT go out with the recorded request flags; a conditional GET that
+ was not modified first learns the file's myftp_stat with an untimed STAT.
+ Paged LISTs ask for the recorded pattern, one page per record, following
+ the cursor of the previous page until the server answers the last one.
+ Sessions that logged in within OPEN_CONN_REQUEST, with a password or a
+ token, log in the same way again with USER and PASSWORD.
+
+ Required files:
+ MakeFile
+ myftp.h
+ myftppipe.h
+ myftppipe.c
+ myftptrace.h
+ myftpreplay.c
+
+ Usage:
+ make all
+ ./replay_{linux|unix} [-f] [-x SPEED] [-c SESSIONS] [-u USER] [-p PASSWORD] TRACE IP PORT
+
+ -f           Send requests as fast as possible instead of at the recorded pace
+ -x SPEED     Pace multiplier, e.g. 2 replays twice as fast (default 1)
+ -c SESSIONS  Number of sessions replayed at once (default 64)
+ -u USER      User name for every session (default alice)
+ -p PASSWORD  Password for every session (default pass1)
+
+ Platform:
+ Linux(e.g.Ubuntu)/SunOS
+
+ */
+
+# include <stdio.h>
+# include <stdlib.h>
+# include <unistd.h>
+# include <string.h>
+# include <stdbool.h>
+# include <errno.h>
+# include <limits.h>
+# include <fcntl.h>
+# include <pthread.h>
+# include <sys/socket.h>
+# include <sys/types.h>
+# include <sys/time.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
+# include "myftp.h"
+# include "myftppipe.h"
+# include "myftptrace.h"
+
+# define LIST_PAGE_SIZE 256	/* what libmyftp asks for, the trace does not record it */
+
+struct request {
+	unsigned long long time;
+	unsigned long long size;
+	unsigned int duration;
+	unsigned char type;
+	unsigned char status;	/* recorded reply status */
+	unsigned char flags;	/* recorded request status flags */
+	char *name;
+	struct myftp_stat known;	/* sent with MYFTP_CONDITIONAL GETs */
+};
+
+struct session {
+	unsigned long long id;
+	struct request *requests;
+	int count, capacity;
+};
+
+struct stat_s {
+	const char *name;
+	unsigned char type;
+	long count, errors;
+	unsigned long long bytes, latency, max_latency, recorded;
+};
+
+const char myftp_protocol[6] = {0xe3,'m','y','f','t','p'};
+
+struct session *sessions = NULL;
+int session_count = 0, next_session = 0;
+unsigned long long trace_start = 0, replay_start = 0;
+bool fast = false;
+double speed = 1;
+char credentials[100];
+struct sockaddr_in server_addr;
+struct stat_s stats[] = {
+	{"OPEN", 0xA1}, {"AUTH", 0xA3}, {"LIST", 0xA5},
+	{"GET", 0xA7}, {"PUT", 0xA9}, {"STAT", 0xAD}, {"QUIT", 0xAB}
+};
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long long now_micros()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+bool send_packet(int sd, const void* buffer, int length)
+{
+	int sentLength = 0;
+	while (sentLength < length) {
+		int len = send(sd, buffer + sentLength, length - sentLength, PIPE_SEND_FLAGS);
+		if (len <= 0) {
+			return false;
+		}
+		sentLength += len;
+	}
+	return true;
+}
+
+bool receive_packet(int sd, void* buffer, int length)
+{
+	int receivedLength = 0;
+	while (receivedLength < length) {
+		int len = recv(sd, buffer + receivedLength, length - receivedLength, 0);
+		if (len <= 0) {
+			return false;
+		}
+		receivedLength += len;
+	}
+	return true;
+}
+
+// Send a request with a payload of len bytes and wait for its reply header
+bool request_data(int sd, unsigned char type, unsigned char status, const void *payload, int len, struct message_s *reply)
+{
+	struct message_s header;
+	char buffer[12 + 512];
+	memcpy(header.protocol, myftp_protocol, 6);
+	header.type = type;
+	header.status = status;
+	header.length = htonl(12 + len);
+
+	// one send, so the payload is not held back by Nagle waiting for an ACK
+	if (len > 512) {
+		return false;
+	}
+	memcpy(buffer, &header, 12);
+	if (len > 0) {
+		memcpy(buffer + 12, payload, len);
+	}
+	if (!send_packet(sd, buffer, 12 + len)) {
+		return false;
+	}
+	if (!receive_packet(sd, reply, 12) || memcmp(reply->protocol, myftp_protocol, 6) != 0 || (unsigned char)reply->type != type + 1) {
+		return false;
+	}
+	reply->length = ntohl(reply->length);
+	return true;
+}
+
+// Send a request with an optional string payload and wait for its reply header
+bool request(int sd, unsigned char type, unsigned char status, const char *payload, struct message_s *reply)
+{
+	return request_data(sd, type, status, payload, payload ? strlen(payload) + 1 : 0, reply);
+}
+
+// Read the rest of a reply body into nowhere, returns its length or -1
+long long skip_body(int sd, struct message_s *reply)
+{
+	long long len = (long long)reply->length - 12;
+	if (len < 0) {
+		return -1;
+	}
+	return pipe_receive_file(sd, -1, len) == len ? len : -1;
+}
+
+// Untimed work before a request, e.g. learn the myftp_stat a recorded NOT_MODIFIED GET matched
+void prepare_request(int sd, struct request *req)
+{
+	struct message_s reply;
+
+	if (sd < 0 || req->type != 0xA7 || !(req->flags & MYFTP_CONDITIONAL) || req->status != MYFTP_NOT_MODIFIED) {
+		return;
+	}
+	if (!request(sd, 0xAD, 0, req->name, &reply)) {
+		return;
+	}
+	if (reply.status == 1 && reply.length == 12 + sizeof(req->known)) {
+		receive_packet(sd, &req->known, sizeof(req->known));
+	} else {
+		skip_body(sd, &reply);
+	}
+}
+
+// Replay one request, returns the number of file bytes moved or -1 on error.
+// cursor carries a paged LIST from one page to the next within the session.
+long long replay_request(int *sd, struct request *req, unsigned long long *cursor)
+{
+	struct myftp_list_request list_request;
+	struct myftp_list_reply page;
+	struct message_s reply, FILE_DATA;
+	long long len;
+	char *payload, name[sizeof(struct myftp_list_request) + NAME_MAX + 1 + sizeof(struct myftp_stat)];
+	unsigned char status;
+	int fd;
+
+	switch (req->type) {
+		case 0xA1:
+			*cursor = 0;
+			*sd = socket(AF_INET, SOCK_STREAM, 0);
+			if (connect(*sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+				close(*sd);
+				*sd = -1;
+				return -1;
+			}
+			if (req->status != MYFTP_LOGGED_IN) {
+				return request(*sd, 0xA1, 0, NULL, &reply) && reply.status == 1 ? 0 : -1;
+			}
+
+			// logged in within OPEN_CONN_REQUEST, skip the token that may come with the reply
+			if (!request(*sd, 0xA1, MYFTP_WITH_AUTH, credentials, &reply) || reply.status != MYFTP_LOGGED_IN ||
+				reply.length < 12 || reply.length > 12 + 256) {
+				return -1;
+			}
+			payload = malloc(reply.length - 12 + 1);
+			len = receive_packet(*sd, payload, reply.length - 12) ? 0 : -1;
+			free(payload);
+			return len;
+		case 0xA3:
+			return request(*sd, 0xA3, 0, credentials, &reply) && reply.status == 1 ? 0 : -1;
+		case 0xA5:
+			if (!(req->flags & MYFTP_PAGED)) {
+				if (!request(*sd, 0xA5, 0, NULL, &reply) || reply.length < 12) {
+					return -1;
+				}
+				payload = malloc(reply.length - 12 + 1);
+				len = receive_packet(*sd, payload, reply.length - 12) ? reply.length - 12 : -1;
+				free(payload);
+				return len;
+			}
+
+			// one page of the recorded pattern, from where the last page of this listing ended
+			if ((len = strlen(req->name) + 1) > NAME_MAX + 1) {
+				return -1;
+			}
+			list_request.cursor_hi = htonl((unsigned int)(*cursor >> 32));
+			list_request.cursor_lo = htonl((unsigned int)*cursor);
+			list_request.max_entries = htonl(LIST_PAGE_SIZE);
+			memcpy(name, &list_request, sizeof(list_request));
+			memcpy(name + sizeof(list_request), req->name, len);
+			if (!request_data(*sd, 0xA5, MYFTP_PAGED, name, sizeof(list_request) + len, &reply) ||
+				reply.length < 12 + sizeof(page) || !receive_packet(*sd, &page, sizeof(page)) ||
+				pipe_receive_file(*sd, -1, reply.length - 12 - sizeof(page)) != reply.length - 12 - sizeof(page)) {
+				return -1;
+			}
+			// status 0 is the last page, the next paged LIST starts a new listing
+			*cursor = reply.status ? ((unsigned long long)ntohl(page.cursor_hi) << 32) | ntohl(page.cursor_lo) : 0;
+			return reply.length - 12;
+		case 0xA7:
+			// ask the way the client did, a conditional GET carries the myftp_stat it matched
+			status = req->flags & (MYFTP_SPARSE | MYFTP_CONDITIONAL | MYFTP_INLINE);
+			if ((len = strlen(req->name) + 1) > NAME_MAX + 1) {
+				return -1;
+			}
+			memcpy(name, req->name, len);
+			if (status & MYFTP_CONDITIONAL) {
+				memcpy(name + len, &req->known, sizeof(req->known));
+				len += sizeof(req->known);
+			}
+			if (!request_data(*sd, 0xA7, status, name, len, &reply) || (len = skip_body(*sd, &reply)) < 0) {
+				return -1;
+			}
+			if (reply.status == MYFTP_NOT_FOUND || reply.status == MYFTP_NOT_MODIFIED) {
+				return 0;
+			}
+			if (reply.status == MYFTP_INLINED) {
+				return len - sizeof(struct myftp_stat);
+			}
+			if (!receive_packet(*sd, &FILE_DATA, 12) || (unsigned char)FILE_DATA.type != 0xFF) {
+				return -1;
+			}
+			if (FILE_DATA.status & MYFTP_SPARSE) {
+				return pipe_receive_sparse(*sd, -1);
+			}
+			len = (unsigned int)ntohl(FILE_DATA.length) - 12;
+			return pipe_receive_file(*sd, -1, len) == len ? len : -1;
+		case 0xA9:
+			if (!request(*sd, 0xA9, 0, req->name, &reply)) {
+				return -1;
+			}
+			// files too large for a plain FILE_DATA header can only go sparse
+			if (req->size > MYFTP_MAX_BODY && !(reply.status & MYFTP_SPARSE)) {
+				return -1;
+			}
+			memcpy(FILE_DATA.protocol, myftp_protocol, 6);
+			FILE_DATA.type = 0xFF;
+			FILE_DATA.status = req->size > MYFTP_MAX_BODY ? MYFTP_SPARSE : 0;
+			FILE_DATA.length = htonl(FILE_DATA.status ? 12 : 12 + req->size);
+			if (!send_packet(*sd, &FILE_DATA, 12) || (fd = open("/dev/zero", O_RDONLY)) < 0) {
+				return -1;
+			}
+			len = FILE_DATA.status ? pipe_send_sparse(*sd, fd, req->size) : pipe_send_file(*sd, fd, req->size);
+			close(fd);
+			return len == req->size ? len : -1;
+		case 0xAD:
+			if (!request(*sd, 0xAD, req->flags & MYFTP_HASH, req->name, &reply) || reply.length < 12) {
+				return -1;
+			}
+			payload = malloc(reply.length - 12 + 1);
+			len = receive_packet(*sd, payload, reply.length - 12) ? 0 : -1;
+			free(payload);
+			return len;
+		case 0xAB:
+			len = request(*sd, 0xAB, 0, NULL, &reply) ? 0 : -1;
+			close(*sd);
+			*sd = -1;
+			return len;
+	}
+	return -1;
+}
+
+void record(struct request *req, unsigned long long latency, long long bytes)
+{
+	int i;
+	for (i = 0; i < sizeof(stats) / sizeof(stats[0]) && stats[i].type != req->type; i++);
+	if (i == sizeof(stats) / sizeof(stats[0])) {
+		return;
+	}
+	pthread_mutex_lock(&stats_mutex);
+	stats[i].count++;
+	stats[i].recorded += req->duration;
+	if (bytes < 0) {
+		stats[i].errors++;
+	} else {
+		stats[i].bytes += bytes;
+		stats[i].latency += latency;
+		if (latency > stats[i].max_latency) {
+			stats[i].max_latency = latency;
+		}
+	}
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+void replay_session(struct session *s)
+{
+	int i, sd = -1;
+	unsigned long long start, target, cursor = 0;
+	long long bytes;
+
+	for (i = 0; i < s->count; i++) {
+		struct request *req = &s->requests[i];
+		if (!fast) {
+			target = replay_start + (unsigned long long)((req->time - trace_start) / speed);
+			start = now_micros();
+			if (target > start) {
+				usleep(target - start);
+			}
+		}
+		if (sd < 0 && req->type != 0xA1) {
+			// The session is broken, or its start was not captured
+			record(req, 0, -1);
+			continue;
+		}
+		prepare_request(sd, req);
+		start = now_micros();
+		bytes = replay_request(&sd, req, &cursor);
+		record(req, now_micros() - start, bytes);
+		if (bytes < 0 && sd >= 0) {
+			close(sd);
+			sd = -1;
+		}
+	}
+	if (sd >= 0) {
+		close(sd);
+	}
+}
+
+void *replayer(void *args)
+{
+	int i;
+	while ((i = __sync_fetch_and_add(&next_session, 1)) < session_count) {
+		replay_session(&sessions[i]);
+	}
+	return NULL;
+}
+
+unsigned long long join64(unsigned int hi, unsigned int lo)
+{
+	return ((unsigned long long)ntohl(hi) << 32) | ntohl(lo);
+}
+
+int compare_requests(const void *a, const void *b)
+{
+	const struct request *x = a, *y = b;
+	return x->time < y->time ? -1 : x->time > y->time;
+}
+
+int compare_sessions(const void *a, const void *b)
+{
+	const struct session *x = a, *y = b;
+	return compare_requests(x->requests, y->requests);
+}
+
+// Open addressing lookup of a session id, returns the matching or the empty slot
+int *find_slot(int *table, int table_size, unsigned long long id)
+{
+	int i;
+	for (i = (int)(id * 0x9E3779B97F4A7C15ULL >> 40) & (table_size - 1); table[i] != -1 && sessions[table[i]].id != id; i = (i + 1) & (table_size - 1));
+	return &table[i];
+}
+
+int load_trace(const char *path)
+{
+	FILE *fp;
+	char magic[8];
+	struct trace_record rec;
+	size_t rec_size = sizeof(rec);
+	int i, *entry, *table, table_size = 1024, capacity = 0, requests = 0;
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		printf("ERROR: Cannot open %s, %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fread(magic, 8, 1, fp) != 1 || (memcmp(magic, TRACE_MAGIC, 8) != 0 && memcmp(magic, TRACE_MAGIC_V1, 8) != 0)) {
+		printf("ERROR: %s is not a trace file.\n", path);
+		fclose(fp);
+		return -1;
+	}
+	if (memcmp(magic, TRACE_MAGIC_V1, 8) == 0) {
+		// no flags byte, it is guessed from the reply status below
+		rec_size--;
+	}
+
+	// Group records by session
+	table = malloc(table_size * sizeof(int));
+	memset(table, -1, table_size * sizeof(int));
+	rec.flags = 0;
+	while (fread(&rec, rec_size, 1, fp) == 1) {
+		struct request req;
+		unsigned long long id = join64(rec.session_hi, rec.session_lo);
+		struct session *s;
+		int index;
+
+		req.time = join64(rec.time_hi, rec.time_lo);
+		req.size = join64(rec.size_hi, rec.size_lo);
+		req.duration = ntohl(rec.duration);
+		req.type = rec.type;
+		req.status = rec.status;
+		req.flags = rec.flags;
+		if (rec_size < sizeof(rec) && rec.type == 0xA7 && rec.status == MYFTP_NOT_MODIFIED) {
+			req.flags = MYFTP_CONDITIONAL | MYFTP_INLINE;
+		} else if (rec_size < sizeof(rec) && rec.type == 0xA7 && rec.status == MYFTP_INLINED) {
+			req.flags = MYFTP_INLINE;
+		}
+		memset(&req.known, 0, sizeof(req.known));
+		req.name = calloc(ntohs(rec.name_length) + 1, 1);
+		if (fread(req.name, 1, ntohs(rec.name_length), fp) != ntohs(rec.name_length)) {
+			free(req.name);
+			break;
+		}
+		if (trace_start == 0 || req.time < trace_start) {
+			trace_start = req.time;
+		}
+
+		entry = find_slot(table, table_size, id);
+		if (*entry == -1) {
+			if (session_count == capacity) {
+				capacity = capacity ? capacity * 2 : 256;
+				sessions = realloc(sessions, capacity * sizeof(struct session));
+			}
+			memset(&sessions[session_count], 0, sizeof(struct session));
+			sessions[session_count].id = id;
+			*entry = session_count++;
+		}
+		index = *entry;
+		if (session_count * 2 > table_size) {
+			// Keep the table at most half full
+			table_size *= 2;
+			table = realloc(table, table_size * sizeof(int));
+			memset(table, -1, table_size * sizeof(int));
+			for (i = 0; i < session_count; i++) {
+				*find_slot(table, table_size, sessions[i].id) = i;
+			}
+		}
+		s = &sessions[index];
+		if (s->count == s->capacity) {
+			s->capacity = s->capacity ? s->capacity * 2 : 8;
+			s->requests = realloc(s->requests, s->capacity * sizeof(struct request));
+		}
+		s->requests[s->count++] = req;
+		requests++;
+	}
+	fclose(fp);
+	free(table);
+
+	// Workers flush their buffers independently, so restore time order
+	for (i = 0; i < session_count; i++) {
+		qsort(sessions[i].requests, sessions[i].count, sizeof(struct request), compare_requests);
+	}
+	qsort(sessions, session_count, sizeof(struct session), compare_sessions);
+	return requests;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, opt, requests, concurrency = 64;
+	char *user = "alice", *password = "pass1";
+	pthread_t *threads;
+	unsigned long long elapsed;
+	long total = 0, errors = 0;
+	bool usage = false;
+
+	while ((opt = getopt(argc, argv, "fx:c:u:p:")) != -1) {
+		switch (opt) {
+			case 'f':
+				fast = true;
+				break;
+			case 'x':
+				speed = atof(optarg);
+				break;
+			case 'c':
+				concurrency = atoi(optarg);
+				break;
+			case 'u':
+				user = optarg;
+				break;
+			case 'p':
+				password = optarg;
+				break;
+			default:
+				usage = true;
+				break;
+		}
+	}
+	if (usage || optind != argc - 3 || speed <= 0 || concurrency < 1) {
+		printf("Usage: %s [-f] [-x speed] [-c sessions] [-u user] [-p password] trace ip port\n", argv[0]);
+		exit(1);
+	}
+	snprintf(credentials, sizeof(credentials), "%s %s", user, password);
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = inet_addr(argv[optind + 1]);
+	server_addr.sin_port = htons(atoi(argv[optind + 2]));
+
+	if ((requests = load_trace(argv[optind])) < 0) {
+		exit(1);
+	}
+	printf("Loaded %d requests in %d sessions from %s\n", requests, session_count, argv[optind]);
+	if (concurrency > session_count) {
+		concurrency = session_count;
+	}
+
+	replay_start = now_micros();
+	threads = malloc(concurrency * sizeof(pthread_t));
+	for (i = 0; i < concurrency; i++) {
+		pthread_create(&threads[i], NULL, replayer, NULL);
+	}
+	for (i = 0; i < concurrency; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	elapsed = now_micros() - replay_start;
+
+	printf("%-5s %8s %7s %14s %10s %10s %13s\n", "type", "count", "errors", "bytes", "avg(ms)", "max(ms)", "recorded(ms)");
+	for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+		struct stat_s *st = &stats[i];
+		long ok = st->count - st->errors;
+		printf("%-5s %8ld %7ld %14llu %10.3f %10.3f %13.3f\n", st->name, st->count, st->errors, st->bytes,
+			   ok ? st->latency / 1000.0 / ok : 0, st->max_latency / 1000.0, st->count ? st->recorded / 1000.0 / st->count : 0);
+		total += st->count;
+		errors += st->errors;
+	}
+	printf("Replayed %ld requests in %.3f s (%.1f requests/s) with %d concurrent sessions, %ld errors\n",
+		   total, elapsed / 1e6, elapsed ? total * 1e6 / elapsed : 0, concurrency, errors);
+	return errors ? 1 : 0;
+}
@@ -21,12 +21,59 @@
  myftp.h
  myftpclient.c
  myftpserver.c
+ myftppipe.h
+ myftppipe.c
+ myftptrace.h
+ myftplog.h
+ myftplog.c
  access.txt
  
  Usage:
  mkdir filedir
  make all
- ./server_{linux|unix} [PORT]
+ ./server_{linux|unix} [-w WORKERS] [-s] [-t TRACE] [-i BYTES] [-l LEVEL] [-r RATE]
+                       [-c CONFIG] [-u SOCKET] [-e SECONDS] [PORT]
+ 
+ -w WORKERS  Fork WORKERS processes, each with its own SO_REUSEPORT
+             listener on PORT and pinned to one of the CPUs in the
+             process's affinity mask. 0 means one worker per such CPU.
+             Crashed workers are restarted.
+ -s          Sharded storage: files are kept in filedir/xx/yy/ fan-out
+             directories chosen by a hash of the name, and LIST is served
+             from the persistent name index filedir/.index. Files left in
+             filedir/ by the flat layout are indexed at startup and still
+             served from there until uploaded again.
+ -t TRACE    Append every request (type, status, size, timing and file
+             name) to the binary trace file TRACE, see myftptrace.h and
+             replay_{linux|unix}.
+ -i BYTES    Files up to BYTES (default 16384, at most 262144) are
+             returned inside the GET_REPLY to clients that accept it,
+             saving a round trip.
+ -l LEVEL    Log level: error, warn, info (default) or debug. SIGUSR1
+             raises and SIGUSR2 lowers the level of a running process;
+             signal the process group to reach every worker.
+ -r RATE     Log at most RATE messages per second from each thread,
+             errors excepted. Messages are queued to a background
+             writer, see myftplog.h.
+ -c CONFIG   Read "name value" lines from CONFIG: inline_bytes, log_level,
+             log_rate, token_lifetime and drain_timeout (seconds a drain
+             waits for sessions, default 300). They override the options
+             above.
+ -u SOCKET   Zero-downtime upgrade. If a server started with the same
+             SOCKET path is running, take its listening sockets over
+             (with -w, one worker per socket), after which it stops
+             accepting, finishes the requests in progress and exits. Only
+             a server run by the same user can take the sockets over.
+ -e SECONDS  Lifetime of the resumption tokens given to clients that log
+             in (default 3600). A client presenting one in its
+             OPEN_CONN_REQUEST is logged in without its password until
+             the token expires or the password changes. 0 disables them.
+ 
+ Signals:
+ SIGHUP      Reload CONFIG and access.txt.
+ SIGQUIT     Stop accepting, close idle sessions, finish the transfers
+             in progress (for at most drain_timeout seconds) and exit.
+ SIGTERM     Exit now.
  
  Platform:
  Linux(e.g.Ubuntu)/SunOS
@@ -42,8 +89,13 @@
  
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -53,37 +105,105 @@
 #include <ctype.h>
 #include <stdbool.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include "myftp.h"
+#include "myftppipe.h"
+#include "myftptrace.h"
+#include "myftplog.h"
 
-#define DEBUG_MODE 0
+#define FILE_DIR "./filedir/"
+#define INDEX_NAME ".index"
+#define INDEX_FILE FILE_DIR INDEX_NAME
+#define LIST_PAGE_MAX 1024
+#define LIST_SCAN_MAX 65536
+#define UPLOAD_PREFIX ".upload."   /* uploads in progress, renamed into place when complete */
+#define ACCESS_FILE "access.txt"
+#define MAX_LISTENERS 253       /* file descriptors one SCM_RIGHTS message can carry */
+#define HANDOFF_TIMEOUT 30      /* seconds the old server waits for the new one to start */
 
-pthread_mutex_t mutex;
-
-struct message_s received_item, send_item;
+__thread struct message_s received_item, send_item;
+__thread bool session_broken = false;  /* the request could not be read, end the session */
 struct sockaddr_in server_addr;
 struct threadargs
 {
     struct sockaddr_in client_addr;
     int client_socket;
-}tas;
+};
 
 const char myftp_protocol[6] = {0xe3,'m','y','f','t','p'};
 int server_socket;
+bool reuse_port = false;
+bool sharded_storage = false;
+unsigned int inline_threshold = 16384;
+struct nameindex
+{
+    char **names;       /* in upload order, so LIST can page by position */
+    int count, capacity;
+    int *table;         /* open addressing, positions in names, -1 = empty */
+    int table_size;
+    off_t synced;       /* bytes of INDEX_FILE already loaded */
+    int fd;
+    pthread_mutex_t lock;
+}name_index;
+struct traceevent
+{
+    char name[NAME_MAX + 1];
+    unsigned long long size;
+    unsigned char status;
+    unsigned char flags;    /* of the request, so replay can ask the same way */
+};
+int trace_fd = -1;
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+char trace_buffer[65536];
+size_t trace_used = 0;
+time_t trace_flushed = 0;
+unsigned int session_counter = 0;
+volatile sig_atomic_t supervisor_stop = 0, supervisor_drain = 0, supervisor_reload = 0;
+int log_rate = 0;
+struct accountlist
+{
+    char (*username)[40];
+    char (*password)[40];
+    int count;
+}*accounts = NULL;
+pthread_rwlock_t accounts_lock = PTHREAD_RWLOCK_INITIALIZER;
+char *config_path = NULL;
+char *upgrade_path = NULL;
+int *listen_sockets = NULL;
+int listen_count = 0;
+int handoff_socket = -1, handoff_ack = -1;
+int wake_pipe[2] = {-1, -1};    /* readable once we are draining */
+volatile bool draining = false;
+int active_sessions = 0;        /* from accept to close, handshake included */
+unsigned int drain_timeout = 300;
+unsigned char token_key[16];
+unsigned int token_lifetime = 3600;
 
-void dump_memory(void const* data, size_t len)
+void dump_memory(const char *what, void const* data, size_t len)
 {
-	if (DEBUG_MODE) {
-		size_t i;
-		printf("Data in [%p..%p): ", data, data + len);
-        for (i = 0; i < len; i++) {
-			printf("%02X ", ((unsigned char*)data)[i]);
-        }
-		printf("\n");
+	// Only as much as fits in one log line
+	if (log_level >= LOG_LEVEL_DEBUG) {
+		char line[LOG_LINE_MAX - 8];
+		size_t i, used;
+		used = snprintf(line, sizeof(line), "%s %lu bytes:", what, (unsigned long)len);
+		for (i = 0; i < len && used + 4 < sizeof(line); i++) {
+			used += snprintf(line + used, sizeof(line) - used, " %02X", ((unsigned char*)data)[i]);
+		}
+		LOG(LOG_LEVEL_DEBUG, "%s%s", line, i < len ? " ..." : "");
 	}
 	return;
 }
@@ -94,15 +214,12 @@ int send_packet(int sd, const void* buffer, int length)
 	while (sentLength < length) {
 		int len = (int)send(sd, buffer + sentLength, length - sentLength, 0);
 		if (len < 0) {
-			printf("ERROR: When sending data, %s (Errno:%d)\n", strerror(errno), errno);
+			LOG(LOG_LEVEL_WARN, "When sending data, %s (Errno:%d)", strerror(errno), errno);
 			break;
 		}
 		sentLength += len;
 	}
-	if (DEBUG_MODE) {
-		printf("Send ");
-		dump_memory(buffer,length);
-	}
+	dump_memory("Send", buffer, length);
 	return sentLength;
 }
 
@@ -112,28 +229,29 @@ int receive_packet(int sd, void* buffer, int length)
 	while (receivedLength < length) {
 		int len = (int)recv(sd, buffer + receivedLength, length - receivedLength, 0);
 		if (len < 0) {
-			printf("ERROR: When receiving data, %s (Errno:%d)\n", strerror(errno), errno);
+			LOG(LOG_LEVEL_WARN, "When receiving data, %s (Errno:%d)", strerror(errno), errno);
+			break;
+		}
+		if (len == 0) {
 			break;
 		}
 		receivedLength += len;
 	}
-	if (DEBUG_MODE) {
-		printf("Receive ");
-		dump_memory(buffer, length);
-	}
+	dump_memory("Receive", buffer, length);
 	return receivedLength;
 }
 
 char** readDir(char* path)
 {
-    char** returnBuffer = (char**)calloc(512, sizeof(char*));
+    int capacity = 512;
+    char** returnBuffer = (char**)calloc(capacity, sizeof(char*));
     int return_code;
     DIR *dir;
     struct dirent *entry = (struct dirent*) calloc (sizeof(struct dirent) + 256, 1);
     struct dirent *result ;
     
     if ((dir = opendir(path)) == NULL)
-        perror("opendir() error");
+        LOG(LOG_LEVEL_ERROR, "opendir() error: %s", strerror(errno));
     else {
         int index=0;
         while(1){
@@ -144,329 +262,1883 @@ char** readDir(char* path)
                 if(return_code==0)
 #endif
                     break;
+            if (index == capacity - 1) {
+                capacity *= 2;
+                returnBuffer = (char**)realloc(returnBuffer, capacity * sizeof(char*));
+            }
             returnBuffer[index] = (char*) calloc(256, sizeof(char));
             memcpy(returnBuffer[index], entry->d_name, strlen(entry->d_name));
             index++;
         }
+        returnBuffer[index] = NULL;
         closedir(dir);
     }
+    free(entry);
     return returnBuffer;
 }
 
-void authenticate(int client_socket)
+unsigned int hashName(const char *name)
 {
-    int i, acc_num;
-    char line[100], username[100][40], password[100][40], login_username[40], login_password[40], *ptr;
-    bool authen_succeeded = false;
-    void *payload;
-    FILE *fp;
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+bool validFilename(const char *name)
+{
+    // Short enough for one path component, with room left in a shard path, and never the name index
+    return name[0] != '\0' && strlen(name) < NAME_MAX && strncmp(name, UPLOAD_PREFIX, strlen(UPLOAD_PREFIX)) && strcmp(name, ".") && strcmp(name, "..") &&
+        strcmp(name, INDEX_NAME) && !strchr(name, '/') && !strchr(name, '\n');
+}
+
+void buildPath(const char *name, char *path, size_t size, bool create)
+{
+    unsigned int h;
+    char flat[PATH_MAX];
+    struct stat st;
     
-    // Wait for AUTH_REQUEST header
-    receive_packet(client_socket, &received_item, 12);
-    received_item.length = ntohl(received_item.length);
+    if (!sharded_storage) {
+        snprintf(path, size, FILE_DIR "%s", name);
+        return;
+    }
     
-    // Wait for AUTH_REQUEST payload
-    payload = malloc(received_item.length - 12);
-    receive_packet(client_socket, payload, received_item.length - 12);
-    ptr = payload;
-    ptr = strtok(ptr, " ");
-    strcpy(login_username, ptr);
-    ptr = strtok(NULL, " ");
-    strcpy(login_password, ptr);
-    
-    // Get username and password from file
-    if (!(fp = fopen("access.txt", "r"))) {
-        perror("password file error");
-        printf("server cannot authenticate...\n");
-        pthread_exit(NULL);
-    } else {
-        strcpy(line, "");
-        for (i = 0; fgets(line, 100, fp) != NULL; i++) {
-            if (strlen(line) == 1) {
-                break;
-            }
-            ptr = line;
-            ptr = strtok(ptr, " ");
-            strcpy(username[i], ptr);
-            ptr = strtok(NULL, "\n");
-            strcpy(password[i], ptr);
-        }
-        fclose(fp);
-        acc_num = i;
-        
-        // Read AUTH_REQUEST
-        if (memcmp(received_item.protocol, myftp_protocol, 6) || (unsigned char)received_item.type != 0xa3) {
-            printf("received abnormal data.\n");
-            pthread_exit(NULL);
-        }
+    // Two-level fan-out, filedir/xx/yy/name, picked by the name hash
+    h = hashName(name);
+    if (create) {
+        snprintf(path, size, FILE_DIR "%02x", h >> 24);
+        mkdir(path, 0755);
+        snprintf(path, size, FILE_DIR "%02x/%02x", h >> 24, (h >> 16) & 0xff);
+        mkdir(path, 0755);
     }
+    snprintf(path, size, FILE_DIR "%02x/%02x/%s", h >> 24, (h >> 16) & 0xff, name);
     
-    // Check username and password
-    for (i = 0; i < acc_num; i++) {
-        if (!strcmp(login_username, username[i]) && !strcmp(login_password, password[i])) {
-            printf("%s logged in\n", login_username);
-            authen_succeeded = true;
+    // Files stored before -s was turned on are still in filedir/ itself, next to the shards and the index
+    if (!create && access(path, F_OK) < 0) {
+        snprintf(flat, sizeof(flat), FILE_DIR "%s", name);
+        if (strcmp(flat, INDEX_FILE) && stat(flat, &st) == 0 && S_ISREG(st.st_mode)) {
+            snprintf(path, size, "%s", flat);
         }
     }
+    return;
+}
+
+// The name index helpers below expect name_index.lock to be held
+int indexLookup(const char *name)
+{
+    int i, mask = name_index.table_size - 1;
     
-    // Send AUTH_REPLY
-    memcpy(send_item.protocol, myftp_protocol, 6);
-    send_item.type = 0xa4;
-    send_item.status = authen_succeeded;
-    send_item.length = 12;
-    send_item.length = htonl(send_item.length);
-    send_packet(client_socket, &send_item, 12);
+    if (name_index.table_size == 0) {
+        return -1;
+    }
+    for (i = hashName(name) & mask; name_index.table[i] != -1; i = (i + 1) & mask) {
+        if (!strcmp(name_index.names[name_index.table[i]], name)) {
+            return name_index.table[i];
+        }
+    }
+    return -1;
+}
+
+void indexInsert(const char *name)
+{
+    int i, j, mask;
     
-    if (!authen_succeeded) {
-        printf("Rejected login attempt\n");
-        close(client_socket);
-        pthread_exit(NULL);
+    if (name_index.count == name_index.capacity) {
+        name_index.capacity = name_index.capacity ? name_index.capacity * 2 : 1024;
+        name_index.names = (char**)realloc(name_index.names, name_index.capacity * sizeof(char*));
     }
+    name_index.names[name_index.count++] = strdup(name);
     
+    // Keep the table at most half full, rehash when it grows
+    if (name_index.count * 2 > name_index.table_size) {
+        free(name_index.table);
+        name_index.table_size = name_index.table_size ? name_index.table_size * 2 : 2048;
+        name_index.table = (int*)malloc(name_index.table_size * sizeof(int));
+        memset(name_index.table, -1, name_index.table_size * sizeof(int));
+        j = 0;
+    } else {
+        j = name_index.count - 1;
+    }
+    mask = name_index.table_size - 1;
+    for (; j < name_index.count; j++) {
+        for (i = hashName(name_index.names[j]) & mask; name_index.table[i] != -1; i = (i + 1) & mask);
+        name_index.table[i] = j;
+    }
     return;
 }
 
-void openConnection()
+void indexSync()
 {
-    int client_addr_size = sizeof(tas.client_addr);
-    pthread_mutex_lock(&mutex);
-    
-    // Ready for client to connect
-    tas.client_socket = accept(server_socket, (struct sockaddr *) &tas.client_addr, (socklen_t *)&client_addr_size);
-    printf("Connected from %s:%hu\n", inet_ntoa(tas.client_addr.sin_addr), tas.client_addr.sin_port);
+    char buffer[4096], *line, *end;
+    ssize_t len;
     
-    // Wait for OPEN_CONN_REQUEST
-    receive_packet(tas.client_socket, &received_item, 12);
-    received_item.length = ntohl(received_item.length);
-    
-    // Read OPEN_CONN_REQUEST
-    if (memcmp(received_item.protocol, myftp_protocol, 6) || (unsigned char)received_item.type != 0xa1) {
-        printf("received abnormal data.\n");
-        close(tas.client_socket);
-        exit(1);
+    // Pick up names appended since the last sync, possibly by other workers
+    while ((len = pread(name_index.fd, buffer, sizeof(buffer), name_index.synced)) > 0) {
+        line = buffer;
+        while ((end = memchr(line, '\n', buffer + len - line)) != NULL) {
+            *end = '\0';
+            if (indexLookup(line) < 0) {
+                indexInsert(line);
+            }
+            line = end + 1;
+        }
+        if (line == buffer) {
+            // Only a partially written line is left
+            break;
+        }
+        name_index.synced += line - buffer;
     }
+    return;
+}
+
+void indexAdd(const char *name)
+{
+    char line[NAME_MAX + 2];
+    int len;
     
-    // Send OPEN_CONN_REPLY
-    memcpy(send_item.protocol, myftp_protocol, 6);
-    send_item.type = 0xa2;
-    send_item.status = 0x01;
-    send_item.length = 12;
-    send_item.length = htonl(send_item.length);
-    send_packet(tas.client_socket, &send_item, 12);
-    printf("Connection opened\n");
-    
+    pthread_mutex_lock(&name_index.lock);
+    indexSync();
+    if (indexLookup(name) < 0) {
+        // O_APPEND keeps whole lines intact between workers
+        len = snprintf(line, sizeof(line), "%s\n", name);
+        if (write(name_index.fd, line, len) != len) {
+            LOG(LOG_LEVEL_ERROR, "index write error: %s", strerror(errno));
+        }
+        indexSync();
+    }
+    pthread_mutex_unlock(&name_index.lock);
     return;
 }
 
-void acceptClient(int port)
+// Add the files of the flat layout, so switching to -s does not hide them from LIST
+void indexFlatFiles()
 {
-    long val = 1;
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(long)) == -1) {
-        perror("setsockopt");
-        exit(1);
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    char path[PATH_MAX];
+    int added = 0;
+    bool known;
+    
+    if ((dir = opendir(FILE_DIR)) == NULL) {
+        return;
     }
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(port);
-    if (bind(server_socket, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
-        perror("bind error");
-        exit(1);
+    while ((entry = readdir(dir)) != NULL) {
+        snprintf(path, sizeof(path), FILE_DIR "%s", entry->d_name);
+        if (!validFilename(entry->d_name) || stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        pthread_mutex_lock(&name_index.lock);
+        known = indexLookup(entry->d_name) >= 0;
+        pthread_mutex_unlock(&name_index.lock);
+        if (!known) {
+            indexAdd(entry->d_name);
+            added++;
+        }
     }
-    if (listen(server_socket, SOMAXCONN) < 0) {
-        perror("listen error");
+    closedir(dir);
+    if (added > 0) {
+        LOG(LOG_LEVEL_INFO, "Indexed %d files from the flat layout", added);
+    }
+    return;
+}
+
+void openIndex()
+{
+    pthread_mutex_init(&name_index.lock, NULL);
+    if ((name_index.fd = open(INDEX_FILE, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+        LOG(LOG_LEVEL_ERROR, "index file error: %s", strerror(errno));
         exit(1);
     }
+    pthread_mutex_lock(&name_index.lock);
+    indexSync();
+    pthread_mutex_unlock(&name_index.lock);
+    indexFlatFiles();
+    LOG(LOG_LEVEL_INFO, "Loaded %d names from %s", name_index.count, INDEX_FILE);
+    return;
 }
 
-void listFile(int client_socket)
+// Read the password file into memory, keeps the old accounts on failure
+bool loadAccounts()
 {
-    // Read directory
-    char** c = readDir("filedir/"), filenames[99999];
-    int i = 0;
-    strcpy(filenames, "");
-    while (c[i] != NULL) {
-        if (strcmp(c[i], ".") && strcmp(c[i], "..")) {
-            strcat(filenames, strcat(c[i], "\n"));
+    int capacity = 100;
+    char line[100], *ptr, *user, *pass;
+    struct accountlist *list, *old;
+    FILE *fp;
+    
+    if (!(fp = fopen(ACCESS_FILE, "r"))) {
+        LOG(LOG_LEVEL_ERROR, "password file error: %s", strerror(errno));
+        return false;
+    }
+    list = (struct accountlist*)calloc(1, sizeof(struct accountlist));
+    list->username = calloc(capacity, sizeof(*list->username));
+    list->password = calloc(capacity, sizeof(*list->password));
+    while (fgets(line, 100, fp) != NULL && strlen(line) > 1) {
+        if ((user = strtok_r(line, " ", &ptr)) == NULL || (pass = strtok_r(NULL, "\n", &ptr)) == NULL) {
+            continue;
+        }
+        if (list->count == capacity) {
+            capacity *= 2;
+            list->username = realloc(list->username, capacity * sizeof(*list->username));
+            list->password = realloc(list->password, capacity * sizeof(*list->password));
         }
-        i++;
+        snprintf(list->username[list->count], 40, "%s", user);
+        snprintf(list->password[list->count], 40, "%s", pass);
+        list->count++;
     }
+    fclose(fp);
     
-    // Send LIST_REPLY
-    memcpy(send_item.protocol, myftp_protocol, 6);
-    send_item.type = 0xa6;
-    send_item.length = 12+(int)strlen(filenames)+1;
-    send_item.length = htonl(send_item.length);
-    send_packet(client_socket, &send_item, 12);
-    send_packet(client_socket, filenames, (int)strlen(filenames)+1);
-    printf("Sent LIST_REPLY\n");
+    pthread_rwlock_wrlock(&accounts_lock);
+    old = accounts;
+    accounts = list;
+    pthread_rwlock_unlock(&accounts_lock);
+    if (old) {
+        free(old->username);
+        free(old->password);
+        free(old);
+    }
+    LOG(LOG_LEVEL_INFO, "Loaded %d accounts from %s", list->count, ACCESS_FILE);
+    return true;
+}
+
+// Inlined files are read into one buffer, so keep them to one transfer chunk
+unsigned int inlineBytes(const char *value)
+{
+    int bytes = atoi(value);
+    return bytes < 0 ? 0 : bytes > PIPE_CHUNK_SIZE ? PIPE_CHUNK_SIZE : (unsigned int)bytes;
+}
+
+// Lines of "name value", settings here override the command line
+void readConfig(const char *path)
+{
+    char line[256], name[64], value[192];
+    int level;
+    FILE *fp;
     
+    if (!(fp = fopen(path, "r"))) {
+        LOG(LOG_LEVEL_ERROR, "config file error: %s", strerror(errno));
+        return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%63s %191s", name, value) != 2) {
+            continue;
+        }
+        if (!strcmp(name, "inline_bytes")) {
+            inline_threshold = inlineBytes(value);
+        } else if (!strcmp(name, "log_level") && (level = log_parse_level(value)) >= 0) {
+            log_level = level;
+        } else if (!strcmp(name, "drain_timeout")) {
+            drain_timeout = (unsigned int)atoi(value);
+        } else if (!strcmp(name, "token_lifetime")) {
+            token_lifetime = (unsigned int)atoi(value);
+        } else if (!strcmp(name, "log_rate")) {
+            log_rate = atoi(value);
+            log_set_rate(log_rate);
+        } else {
+            LOG(LOG_LEVEL_WARN, "Unknown setting %s in %s", name, path);
+        }
+    }
+    fclose(fp);
+    return;
+}
+
+void reloadConfig()
+{
+    if (config_path) {
+        readConfig(config_path);
+    }
+    loadAccounts();
+    LOG(LOG_LEVEL_INFO, "Configuration reloaded");
+    return;
 }
 
-void uploadFile(struct message_s PUT_REQUEST, int client_socket)
+// Look the password of user up, false if there is no such account
+bool findPassword(const char *user, char *password)
 {
-	printf("receive PUT_REQUEST\n");
+    int i;
+    bool found = false;
     
-	// Receive PUT_REQUEST
-	if (PUT_REQUEST.length < 13) {
-		printf("ERROR: Received wrong data. Command ignored.\n");
-		return;
-	}
-	void *payload = malloc(256);
-	receive_packet(client_socket, payload, PUT_REQUEST.length - 12);
-	printf("send PUT_REPLY\n");
+    pthread_rwlock_rdlock(&accounts_lock);
+    for (i = 0; accounts != NULL && i < accounts->count && !found; i++) {
+        if (!strcmp(user, accounts->username[i])) {
+            strcpy(password, accounts->password[i]);
+            found = true;
+        }
+    }
+    pthread_rwlock_unlock(&accounts_lock);
+    return found;
+}
+
+// Payload "user password" of AUTH_REQUEST or a MYFTP_WITH_AUTH OPEN_CONN_REQUEST
+bool checkCredentials(char *payload, char *login_username)
+{
+    char password[40], *user, *pass, *ptr;
     
-	// Send PUT_REPLY
-	struct message_s PUT_REPLY;
-	memcpy(PUT_REPLY.protocol, myftp_protocol, 6);
-	PUT_REPLY.type = 0xAA;
+    if (accounts == NULL) {
+        LOG(LOG_LEVEL_ERROR, "server cannot authenticate...");
+        return false;
+    }
+    if ((user = strtok_r(payload, " ", &ptr)) == NULL || (pass = strtok_r(NULL, " ", &ptr)) == NULL || strlen(user) >= 40) {
+        return false;
+    }
+    if (!findPassword(user, password) || strcmp(pass, password)) {
+        return false;
+    }
+    strcpy(login_username, user);
+    LOG(LOG_LEVEL_INFO, "%s logged in", login_username);
+    return true;
+}
+
+void sipRound(unsigned long long *v)
+{
+    v[0] += v[1]; v[1] = (v[1] << 13) | (v[1] >> 51); v[1] ^= v[0]; v[0] = (v[0] << 32) | (v[0] >> 32);
+    v[2] += v[3]; v[3] = (v[3] << 16) | (v[3] >> 48); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = (v[3] << 21) | (v[3] >> 43); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = (v[1] << 17) | (v[1] >> 47); v[1] ^= v[2]; v[2] = (v[2] << 32) | (v[2] >> 32);
+    return;
+}
+
+// SipHash-2-4, a keyed hash meant for authenticating short messages
+unsigned long long sipHash(const unsigned char *key, const unsigned char *data, size_t len)
+{
+    unsigned long long k0 = 0, k1 = 0, m, v[4];
+    size_t i, j;
     
-	// PUT_REPLY.status = unused;
-	PUT_REPLY.length = htonl(12);
-	send_packet(client_socket, &PUT_REPLY, 12);
-	printf("wait and receive FILE_DATA\n");
+    for (i = 0; i < 8; i++) {
+        k0 |= (unsigned long long)key[i] << (8 * i);
+        k1 |= (unsigned long long)key[i + 8] << (8 * i);
+    }
+    v[0] = k0 ^ 0x736f6d6570736575ULL;
+    v[1] = k1 ^ 0x646f72616e646f6dULL;
+    v[2] = k0 ^ 0x6c7967656e657261ULL;
+    v[3] = k1 ^ 0x7465646279746573ULL;
+    for (i = 0; i + 8 <= len; i += 8) {
+        for (m = 0, j = 0; j < 8; j++) {
+            m |= (unsigned long long)data[i + j] << (8 * j);
+        }
+        v[3] ^= m;
+        sipRound(v);
+        sipRound(v);
+        v[0] ^= m;
+    }
+    for (m = (unsigned long long)len << 56, j = 0; i + j < len; j++) {
+        m |= (unsigned long long)data[i + j] << (8 * j);
+    }
+    v[3] ^= m;
+    sipRound(v);
+    sipRound(v);
+    v[0] ^= m;
+    v[2] ^= 0xff;
+    for (i = 0; i < 4; i++) {
+        sipRound(v);
+    }
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+// The password is part of the MAC, so changing it in access.txt revokes old tokens
+unsigned long long tokenMac(struct myftp_token *token, const char *password)
+{
+    unsigned char data[sizeof(struct myftp_token) + 40];
+    size_t len = offsetof(struct myftp_token, mac_hi);
     
-	// Wait and receive FILE_DATA
-	struct message_s FILE_DATA;
-	receive_packet(client_socket, &FILE_DATA, 12);
-	int len_of_payload = ntohl(FILE_DATA.length) - 12;
-	void *file_payload = malloc(len_of_payload);
-	receive_packet(client_socket, file_payload, len_of_payload);
-	if (memcmp(FILE_DATA.protocol, myftp_protocol,6) !=0 || FILE_DATA.type != (char)0xFF || ntohl(FILE_DATA.length) < 12) {
-		printf("ERROR: Received wrong data. Connection closed.\n");
-		return;
-	}
-	char *filename = malloc(280);
-	strcpy(filename, "./filedir/");
-	strcat(filename, (char*)payload);
-	FILE *fp = fopen(filename, "wb");
-	fwrite(file_payload, 1, (size_t)len_of_payload, fp);
-	fclose(fp);
-	printf("File uploaded.\n");
+    memcpy(data, token, len);
+    memset(data + len, 0, 40);
+    strncpy((char *)data + len, password, 40);
+    return sipHash(token_key, data, len + 40);
+}
+
+// False if tokens are disabled
+bool makeToken(const char *user, struct myftp_token *token)
+{
+    char password[40];
+    unsigned long long expiry = (unsigned long long)time(NULL) + token_lifetime, mac;
     
-	return;
+    if (token_lifetime == 0 || !findPassword(user, password)) {
+        return false;
+    }
+    memset(token, 0, sizeof(*token));
+    token->expiry_hi = htonl((unsigned int)(expiry >> 32));
+    token->expiry_lo = htonl((unsigned int)expiry);
+    strncpy(token->user, user, sizeof(token->user) - 1);
+    mac = tokenMac(token, password);
+    token->mac_hi = htonl((unsigned int)(mac >> 32));
+    token->mac_lo = htonl((unsigned int)mac);
+    return true;
 }
 
-void downloadFile(struct message_s GET_REQUEST, int client_socket)
+bool checkToken(struct myftp_token *token, char *login_username)
 {
-	// Receive GET_REQUEST
-	if (GET_REQUEST.length < 13) {
-		printf("ERROR: Received wrong data. Command ignored.\n");
-		return;
-	}
-	void *payload = malloc(256);
-	receive_packet(client_socket, payload, GET_REQUEST.length - 12);
+    char password[40];
+    unsigned long long expiry = ((unsigned long long)ntohl(token->expiry_hi) << 32) | ntohl(token->expiry_lo);
+    unsigned long long mac = ((unsigned long long)ntohl(token->mac_hi) << 32) | ntohl(token->mac_lo);
     
-	// Send GET_REPLY
-	struct message_s GET_REPLY;
-	memcpy(GET_REPLY.protocol, myftp_protocol, 6);
-	GET_REPLY.type = 0xA8;
-	FILE *fp;
-	char *filename = malloc(280);
-	strcpy(filename, "./filedir/");
-	strcat(filename, (char*)payload);
-	if ((fp = fopen(filename, "rb")) == NULL) {
-		printf("ERROR: The request file is not existed.\n");
-		GET_REPLY.status = 0;
-	} else {
-		GET_REPLY.status = 1;
-	}
-	GET_REPLY.length = htonl(12);
-	send_packet(client_socket, &GET_REPLY, 12);
-	
-	if (GET_REPLY.status == 0) {
-		return;
-	}
-	
-	//send FILE_DATA
-	struct message_s FILE_DATA;
-	memcpy(FILE_DATA.protocol, myftp_protocol, 6);
-	FILE_DATA.type = 0xFF;
-	fseek(fp, 0, SEEK_END);
-	int len_of_payload = (int)ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	FILE_DATA.length = htonl(12 + len_of_payload);
-	send_packet(client_socket, &FILE_DATA, 12);
-	void *file_payload = malloc(len_of_payload);
-	fread(file_payload, (size_t)len_of_payload, 1, fp);
-	fclose(fp);
-	send_packet(client_socket, file_payload, len_of_payload);
-	printf("File downloaded.\n");
+    token->user[sizeof(token->user) - 1] = '\0';
+    if (token_lifetime == 0 || expiry < (unsigned long long)time(NULL) || !findPassword(token->user, password) ||
+        tokenMac(token, password) != mac) {
+        return false;
+    }
+    strcpy(login_username, token->user);
+    LOG(LOG_LEVEL_INFO, "%s resumed a session", login_username);
+    return true;
+}
+
+void openTokenKey()
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+    unsigned long long seed = (unsigned long long)time(NULL) ^ ((unsigned long long)getpid() << 32);
     
-	return;
+    if (fd < 0 || read(fd, token_key, sizeof(token_key)) != sizeof(token_key)) {
+        // Still unguessable enough to tell sessions apart, not to resist attackers
+        LOG(LOG_LEVEL_WARN, "No /dev/urandom, resumption tokens are weak");
+        memcpy(token_key, &seed, sizeof(seed));
+        memcpy(token_key + 8, &seed, sizeof(seed));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return;
 }
 
-void quit(int client_socket, struct sockaddr_in client_addr)
+// Send AUTH_REPLY or OPEN_CONN_REPLY, followed by a token if logged in and asked for
+void sendLoginReply(int client_socket, unsigned char type, unsigned char status, const char *user)
 {
-    // Send QUIT_REPLY
-    memcpy(send_item.protocol, myftp_protocol, 6);
-    send_item.type = 0xac;
-    send_item.length = 12;
-    send_item.length = htonl(send_item.length);
-    send_packet(client_socket, &send_item, 12);
-    printf("Connection from %s:%hu is closed\n", inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
+    struct
+    {
+        struct message_s header;
+        struct myftp_token token;
+    }reply;
+    int len = 12;
+    
+    if (user != NULL && makeToken(user, &reply.token)) {
+        len += sizeof(reply.token);
+    }
+    memcpy(reply.header.protocol, myftp_protocol, 6);
+    reply.header.type = type;
+    reply.header.status = status;
+    reply.header.length = htonl(len);
+    send_packet(client_socket, &reply, len);
+    return;
 }
 
-bool waitForOperation(int client_socket, struct sockaddr_in client_addr)
+// False if the client did not log in
+bool authenticate(int client_socket)
 {
-    // Wait for request
+    char login_username[40];
+    bool authen_succeeded = false;
+    char *payload;
+    
+    // Wait for AUTH_REQUEST header
     receive_packet(client_socket, &received_item, 12);
     received_item.length = ntohl(received_item.length);
     
-    // Read and determine type of request
-    if (memcmp(received_item.protocol, myftp_protocol, 6) != 0) {
-        printf("received abnormal data.\n");
+    // Read AUTH_REQUEST
+    if (memcmp(received_item.protocol, myftp_protocol, 6) || (unsigned char)received_item.type != 0xa3 ||
+        received_item.length <= 12 || received_item.length > 12 + 256) {
+        LOG(LOG_LEVEL_WARN, "received abnormal data.");
         return false;
     }
-    switch ((unsigned char)received_item.type) {
-        case 0xa5:
-            listFile(client_socket);
-            return false;
-        case 0xa7:
-            downloadFile(received_item, client_socket);
-            return false;
-        case 0xa9:
-            uploadFile(received_item, client_socket);
-            return false;
-        case 0xab:
-            quit(client_socket, client_addr);
-            break;
-        default:
-            printf("received abnormal data.\n");
-            return false;
+    
+    // Wait for AUTH_REQUEST payload
+    payload = malloc(received_item.length - 12 + 1);
+    receive_packet(client_socket, payload, received_item.length - 12);
+    payload[received_item.length - 12] = '\0';
+    authen_succeeded = checkCredentials(payload, login_username);
+    free(payload);
+    
+    // Send AUTH_REPLY
+    sendLoginReply(client_socket, 0xa4, authen_succeeded,
+                   authen_succeeded && (received_item.status & MYFTP_RESUME) ? login_username : NULL);
+    
+    if (!authen_succeeded) {
+        LOG(LOG_LEVEL_WARN, "Rejected login attempt");
     }
     
-    return true;
-}
-
-void * pthread_prog(void * args)
-{
-    struct threadargs foo = *(struct threadargs*)args;
-    authenticate(foo.client_socket);
-    while (!waitForOperation(foo.client_socket, foo.client_addr));
-	return 0;
+    return authen_succeeded;
 }
 
-int main(int argc, char *argv[])
+// Returns 1 if the client logged in within OPEN_CONN_REQUEST, 0 if it still has to, -1 on bad data
+int openConnection(int client_socket)
 {
-    pthread_t thread;
-    pthread_mutex_init(&mutex, NULL);
+    char login_username[40], *payload = NULL;
+    int len_of_payload;
+    bool logged_in = false;
     
-    if (!argv[1]) {
-        printf("Usage: %s [port]\n", argv[0]);
-        exit(1);
+    // Wait for OPEN_CONN_REQUEST
+    if (receive_packet(client_socket, &received_item, 12) < 12) {
+        return -1;
     }
-    acceptClient(atoi(argv[1]));
+    received_item.length = ntohl(received_item.length);
     
-    while (1) {
-        openConnection();
-        pthread_mutex_unlock(&mutex);
+    // Read OPEN_CONN_REQUEST
+    if (memcmp(received_item.protocol, myftp_protocol, 6) || (unsigned char)received_item.type != 0xa1 ||
+        received_item.length < 12 || received_item.length > 12 + 256) {
+        LOG(LOG_LEVEL_WARN, "received abnormal data.");
+        return -1;
+    }
+    len_of_payload = received_item.length - 12;
+    if (len_of_payload > 0) {
+        payload = malloc(len_of_payload + 1);
+        if (receive_packet(client_socket, payload, len_of_payload) < len_of_payload) {
+            free(payload);
+            return -1;
+        }
+        payload[len_of_payload] = '\0';
+    }
+    
+    // Log in within the same round trip, with a token or a password
+    if ((received_item.status & MYFTP_RESUME) && len_of_payload == sizeof(struct myftp_token)) {
+        logged_in = checkToken((struct myftp_token *)payload, login_username);
+    } else if ((received_item.status & MYFTP_WITH_AUTH) && len_of_payload > 0) {
+        logged_in = checkCredentials(payload, login_username);
+    }
+    free(payload);
+    
+    // Send OPEN_CONN_REPLY
+    sendLoginReply(client_socket, 0xa2, logged_in ? MYFTP_LOGGED_IN : 0x01, logged_in ? login_username : NULL);
+    LOG(LOG_LEVEL_DEBUG, "Connection opened");
+    
+    return logged_in;
+}
+
+void acceptClient(int port)
+{
+    long val = 1;
+    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(long)) == -1) {
+        LOG(LOG_LEVEL_ERROR, "setsockopt: %s", strerror(errno));
+        exit(1);
+    }
+    if (reuse_port) {
+#ifdef SO_REUSEPORT
+        int on = 1;
+        if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+            LOG(LOG_LEVEL_ERROR, "setsockopt SO_REUSEPORT: %s", strerror(errno));
+            exit(1);
+        }
+#else
+        LOG(LOG_LEVEL_WARN, "SO_REUSEPORT is not supported on this platform");
+        exit(1);
+#endif
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_port = htons(port);
+    if (bind(server_socket, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0) {
+        LOG(LOG_LEVEL_ERROR, "bind error: %s", strerror(errno));
+        exit(1);
+    }
+    if (listen(server_socket, SOMAXCONN) < 0) {
+        LOG(LOG_LEVEL_ERROR, "listen error: %s", strerror(errno));
+        exit(1);
+    }
+}
+
+void addListener(int sd)
+{
+    listen_sockets = (int*)realloc(listen_sockets, (listen_count + 1) * sizeof(int));
+    listen_sockets[listen_count++] = sd;
+    return;
+}
+
+// The sockets and the token key only go between servers run by the same user
+bool trustedPeer(int sd)
+{
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(sd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == geteuid();
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(sd, &uid, &gid) == 0 && uid == geteuid();
+#else
+    // Left to the 0600 mode of the socket file
+    return true;
+#endif
+}
+
+// Take the listening sockets over from a server running with the same -u path
+int receiveListeners(const char *path)
+{
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union
+    {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+    }control;
+    unsigned char key[sizeof(token_key)];
+    int sd, i, count;
+    ssize_t len;
+    
+    sd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (connect(sd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        // Nobody to take over from
+        close(sd);
+        return 0;
+    }
+    if (!trustedPeer(sd)) {
+        LOG(LOG_LEVEL_ERROR, "%s belongs to another user, not taking over", path);
+        close(sd);
+        return 0;
+    }
+    
+    // The sockets come with the token key, so tokens outlive the upgrade
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = key;
+    iov.iov_len = sizeof(key);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    if ((len = recvmsg(sd, &msg, 0)) < 1 || (msg.msg_flags & MSG_CTRUNC) || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        LOG(LOG_LEVEL_ERROR, "No listening sockets received from %s", path);
+        close(sd);
+        return 0;
+    }
+    count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    for (i = 0; i < count; i++) {
+        addListener(((int*)CMSG_DATA(cmsg))[i]);
+    }
+    if (len == sizeof(key)) {
+        memcpy(token_key, key, sizeof(key));
+    }
+    
+    // Acknowledged by confirmHandoff() once we are serving
+    handoff_ack = sd;
+    LOG(LOG_LEVEL_INFO, "Took over %d listening socket(s) from %s", count, path);
+    return count;
+}
+
+bool sendListeners(int sd)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union
+    {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(MAX_LISTENERS * sizeof(int))];
+    }control;
+    
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = token_key;
+    iov.iov_len = sizeof(token_key);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = CMSG_SPACE(listen_count * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(listen_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), listen_sockets, listen_count * sizeof(int));
+    return sendmsg(sd, &msg, 0) == sizeof(token_key);
+}
+
+// Old server: hand the listeners to the first new server that starts, then drain
+void * handoffThread(void * args)
+{
+    struct timeval timeout = {HANDOFF_TIMEOUT, 0};
+    sigset_t set;
+    char byte;
+    int sd;
+    
+    // Leave signals to the threads that handle them
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    
+    while ((sd = accept(handoff_socket, NULL, NULL)) >= 0 || errno == EINTR) {
+        if (sd < 0) {
+            continue;
+        }
+        if (!trustedPeer(sd)) {
+            LOG(LOG_LEVEL_WARN, "Refused a handoff to a process of another user");
+            close(sd);
+            continue;
+        }
+        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (!sendListeners(sd) || recv(sd, &byte, 1, 0) != 1) {
+            LOG(LOG_LEVEL_WARN, "Handoff to the new server failed, still serving");
+            close(sd);
+            continue;
+        }
+        close(sd);
         
-        // Create thread
-        pthread_create(&thread, NULL, pthread_prog, &tas);
+        // The new server has bound the path itself by now, so do not unlink it
+        close(handoff_socket);
+        LOG(LOG_LEVEL_INFO, "Listening sockets handed over");
+        kill(getpid(), SIGQUIT);
+        break;
+    }
+    return 0;
+}
+
+void openHandoff(const char *path)
+{
+    struct sockaddr_un addr;
+    pthread_t thread;
+    
+    handoff_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    if (bind(handoff_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0 || chmod(path, 0600) < 0 ||
+        listen(handoff_socket, 1) < 0) {
+        LOG(LOG_LEVEL_ERROR, "upgrade socket error: %s", strerror(errno));
+        close(handoff_socket);
+        return;
+    }
+    if (pthread_create(&thread, NULL, handoffThread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+    return;
+}
+
+// Tell the old server we are accepting, so it can stop
+void confirmHandoff()
+{
+    char byte = 1;
+    
+    if (handoff_ack >= 0) {
+        if (write(handoff_ack, &byte, 1) != 1) {
+            LOG(LOG_LEVEL_WARN, "upgrade acknowledgement failed: %s", strerror(errno));
+        }
+        close(handoff_ack);
+        handoff_ack = -1;
+    }
+    return;
+}
+
+void appendName(char **buffer, size_t *used, size_t *capacity, const char *name)
+{
+    size_t len = strlen(name);
+    
+    while (*used + len + 2 > *capacity) {
+        *capacity *= 2;
+        *buffer = (char*)realloc(*buffer, *capacity);
+    }
+    memcpy(*buffer + *used, name, len);
+    *used += len;
+    (*buffer)[(*used)++] = '\n';
+    (*buffer)[*used] = '\0';
+    return;
+}
+
+unsigned long long nowMicros()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Expects trace_mutex to be held
+void traceFlush()
+{
+    // O_APPEND and whole records per write keep workers from interleaving
+    if (trace_used > 0 && write(trace_fd, trace_buffer, trace_used) != (ssize_t)trace_used) {
+        LOG(LOG_LEVEL_ERROR, "trace write error: %s", strerror(errno));
+    }
+    trace_used = 0;
+    trace_flushed = time(NULL);
+    return;
+}
+
+void traceRecord(unsigned long long session, unsigned char type, unsigned long long start, struct traceevent *event)
+{
+    struct trace_record record;
+    size_t name_length = strlen(event->name);
+    
+    if (trace_fd < 0) {
+        return;
+    }
+    record.time_hi = htonl((unsigned int)(start >> 32));
+    record.time_lo = htonl((unsigned int)start);
+    record.session_hi = htonl((unsigned int)(session >> 32));
+    record.session_lo = htonl((unsigned int)session);
+    record.size_hi = htonl((unsigned int)(event->size >> 32));
+    record.size_lo = htonl((unsigned int)event->size);
+    record.duration = htonl((unsigned int)(nowMicros() - start));
+    record.type = type;
+    record.status = event->status;
+    record.name_length = htons((unsigned short)name_length);
+    record.flags = event->flags;
+    
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_used + sizeof(record) + name_length > sizeof(trace_buffer)) {
+        traceFlush();
+    }
+    memcpy(trace_buffer + trace_used, &record, sizeof(record));
+    memcpy(trace_buffer + trace_used + sizeof(record), event->name, name_length);
+    trace_used += sizeof(record) + name_length;
+    if (type == 0xab || time(NULL) != trace_flushed) {
+        traceFlush();
+    }
+    pthread_mutex_unlock(&trace_mutex);
+    return;
+}
+
+void openTrace(const char *path)
+{
+    struct stat st;
+    char magic[8];
+    
+    if ((trace_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0 || fstat(trace_fd, &st) < 0) {
+        LOG(LOG_LEVEL_ERROR, "trace file error: %s", strerror(errno));
+        exit(1);
+    }
+    
+    // Appending records of another format would make the whole file unreadable
+    if (st.st_size > 0 && (pread(trace_fd, magic, 8, 0) != 8 || memcmp(magic, TRACE_MAGIC, 8))) {
+        LOG(LOG_LEVEL_ERROR, "%s is not a trace file of this version", path);
+        exit(1);
+    }
+    if (st.st_size == 0 && write(trace_fd, TRACE_MAGIC, 8) != 8) {
+        LOG(LOG_LEVEL_ERROR, "trace file error: %s", strerror(errno));
+        exit(1);
+    }
+    LOG(LOG_LEVEL_INFO, "Recording trace to %s", path);
+    return;
+}
+
+void packStat(struct myftp_stat *ms, struct stat *st, unsigned long long hash)
+{
+    ms->size_hi = htonl((unsigned int)((unsigned long long)st->st_size >> 32));
+    ms->size_lo = htonl((unsigned int)st->st_size);
+    ms->mtime_hi = htonl((unsigned int)((unsigned long long)st->st_mtime >> 32));
+    ms->mtime_lo = htonl((unsigned int)st->st_mtime);
+    ms->hash_hi = htonl((unsigned int)(hash >> 32));
+    ms->hash_lo = htonl((unsigned int)hash);
+    return;
+}
+
+unsigned long long statField(unsigned int hi, unsigned int lo)
+{
+    return ((unsigned long long)ntohl(hi) << 32) | ntohl(lo);
+}
+
+// Append one entry to a paged LIST_REPLY, false if the file is gone
+bool appendEntry(char *buffer, int *used, const char *name, const char *path)
+{
+    struct myftp_list_entry entry;
+    struct stat st;
+    size_t len = strlen(name);
+    
+    if (stat(path, &st) < 0) {
+        return false;
+    }
+    entry.size_hi = htonl((unsigned int)((unsigned long long)st.st_size >> 32));
+    entry.size_lo = htonl((unsigned int)st.st_size);
+    entry.mtime_hi = htonl((unsigned int)((unsigned long long)st.st_mtime >> 32));
+    entry.mtime_lo = htonl((unsigned int)st.st_mtime);
+    entry.type = S_ISREG(st.st_mode) ? 'f' : S_ISDIR(st.st_mode) ? 'd' : '?';
+    entry.name_length = htons((unsigned short)len);
+    memcpy(buffer + *used, &entry, sizeof(entry));
+    memcpy(buffer + *used + sizeof(entry), name, len);
+    *used += sizeof(entry) + len;
+    return true;
+}
+
+void listPage(int client_socket, const char *payload, struct traceevent *event)
+{
+    struct myftp_list_request request;
+    struct myftp_list_reply page;
+    struct message_s LIST_REPLY;
+    const char *pattern = payload + sizeof(request), **names;
+    unsigned long long cursor;
+    unsigned int max_entries, scanned = 0;
+    int i, n = 0, used;
+    bool more = false;
+    char path[PATH_MAX], *reply;
+    DIR *dir;
+    struct dirent *entry;
+    
+    memcpy(&request, payload, sizeof(request));
+    cursor = statField(request.cursor_hi, request.cursor_lo);
+    max_entries = ntohl(request.max_entries);
+    if (max_entries == 0 || max_entries > LIST_PAGE_MAX) {
+        max_entries = LIST_PAGE_MAX;
+    }
+    reply = (char*)malloc(12 + sizeof(page) + max_entries * (sizeof(struct myftp_list_entry) + NAME_MAX));
+    used = 12 + sizeof(page);
+    
+    if (sharded_storage) {
+        // The cursor is a position in the name index
+        names = (const char**)malloc(max_entries * sizeof(char*));
+        pthread_mutex_lock(&name_index.lock);
+        indexSync();
+        while (cursor < name_index.count && n < max_entries && scanned++ < LIST_SCAN_MAX) {
+            const char *name = name_index.names[cursor++];
+            if (!*pattern || !fnmatch(pattern, name, 0)) {
+                names[n++] = name;
+            }
+        }
+        more = cursor < name_index.count;
+        pthread_mutex_unlock(&name_index.lock);
+        
+        // Names are never freed, so they can be used without the lock
+        for (i = 0; i < n; i++) {
+            buildPath(names[i], path, sizeof(path), false);
+            appendEntry(reply, &used, names[i], path);
+        }
+        free(names);
+    } else if ((dir = opendir(FILE_DIR)) != NULL) {
+        // The cursor is a telldir() position, which files coming and going do not shift
+        if (cursor > 0) {
+            seekdir(dir, (long)cursor);
+        }
+        while ((entry = readdir(dir)) != NULL) {
+            if (n == max_entries || scanned++ == LIST_SCAN_MAX) {
+                more = true;
+                break;
+            }
+            cursor = (unsigned long long)telldir(dir);
+            if (!validFilename(entry->d_name) || (*pattern && fnmatch(pattern, entry->d_name, 0))) {
+                continue;
+            }
+            snprintf(path, sizeof(path), FILE_DIR "%s", entry->d_name);
+            if (appendEntry(reply, &used, entry->d_name, path)) {
+                n++;
+            }
+        }
+        closedir(dir);
+    } else {
+        LOG(LOG_LEVEL_ERROR, "opendir() error: %s", strerror(errno));
+    }
+    
+    // Send LIST_REPLY
+    memcpy(LIST_REPLY.protocol, myftp_protocol, 6);
+    LIST_REPLY.type = 0xa6;
+    LIST_REPLY.status = more;
+    LIST_REPLY.length = htonl(used);
+    page.cursor_hi = htonl((unsigned int)(cursor >> 32));
+    page.cursor_lo = htonl((unsigned int)cursor);
+    memcpy(reply, &LIST_REPLY, 12);
+    memcpy(reply + 12, &page, sizeof(page));
+    send_packet(client_socket, reply, used);
+    free(reply);
+    snprintf(event->name, sizeof(event->name), "%s", pattern);
+    event->size = used - 12;
+    event->status = more;
+    LOG(LOG_LEVEL_DEBUG, "Sent LIST_REPLY page");
+    
+    return;
+}
+
+void listFile(struct message_s LIST_REQUEST, int client_socket, struct traceevent *event)
+{
+    char **c, *filenames, *payload;
+    size_t used = 0, capacity = 4096;
+    int i;
+    
+    // Paged requests carry a cursor and a pattern, older clients send a bare header
+    if ((LIST_REQUEST.status & MYFTP_PAGED) && LIST_REQUEST.length >= 12 + sizeof(struct myftp_list_request) &&
+        LIST_REQUEST.length <= 12 + sizeof(struct myftp_list_request) + PATH_MAX) {
+        payload = (char*)calloc(LIST_REQUEST.length - 12 + 1, 1);
+        receive_packet(client_socket, payload, LIST_REQUEST.length - 12);
+        listPage(client_socket, payload, event);
+        free(payload);
+        return;
+    }
+    if ((unsigned int)LIST_REQUEST.length > 12) {
+        // Skip whatever else came with it, so the next request is read from the right place
+        LOG(LOG_LEVEL_WARN, "Ignored a malformed LIST_REQUEST payload");
+        pipe_receive_file(client_socket, -1, (unsigned int)LIST_REQUEST.length - 12);
+    }
+    
+    filenames = (char*)malloc(capacity);
+    strcpy(filenames, "");
+    if (sharded_storage) {
+        // Read the name index
+        pthread_mutex_lock(&name_index.lock);
+        indexSync();
+        for (i = 0; i < name_index.count; i++) {
+            appendName(&filenames, &used, &capacity, name_index.names[i]);
+        }
+        pthread_mutex_unlock(&name_index.lock);
+    } else {
+        // Read directory
+        c = readDir(FILE_DIR);
+        for (i = 0; c[i] != NULL; i++) {
+            if (validFilename(c[i])) {
+                appendName(&filenames, &used, &capacity, c[i]);
+            }
+            free(c[i]);
+        }
+        free(c);
+    }
+    
+    // Send LIST_REPLY
+    memcpy(send_item.protocol, myftp_protocol, 6);
+    send_item.type = 0xa6;
+    send_item.length = 12+(int)strlen(filenames)+1;
+    send_item.length = htonl(send_item.length);
+    send_packet(client_socket, &send_item, 12);
+    send_packet(client_socket, filenames, (int)strlen(filenames)+1);
+    event->size = strlen(filenames) + 1;
+    event->status = 1;
+    free(filenames);
+    LOG(LOG_LEVEL_DEBUG, "Sent LIST_REPLY");
+    
+}
+
+// A request too long to be real, its payload is not read so the session cannot go on
+void rejectRequest(int client_socket)
+{
+    LOG(LOG_LEVEL_WARN, "Received wrong data. Connection closed.");
+    session_broken = true;
+    return;
+}
+
+void uploadFile(struct message_s PUT_REQUEST, int client_socket, struct traceevent *event)
+{
+	LOG(LOG_LEVEL_DEBUG, "receive PUT_REQUEST");
+    
+	// Receive PUT_REQUEST
+	if (PUT_REQUEST.length < 13) {
+		LOG(LOG_LEVEL_WARN, "Received wrong data. Command ignored.");
+		return;
+	}
+	if (PUT_REQUEST.length > 12 + NAME_MAX + 1) {
+		rejectRequest(client_socket);
+		return;
+	}
+	char *payload = calloc(PUT_REQUEST.length - 12 + 1, 1);
+	receive_packet(client_socket, payload, PUT_REQUEST.length - 12);
+	LOG(LOG_LEVEL_DEBUG, "send PUT_REPLY");
+    
+	// Send PUT_REPLY
+	struct message_s PUT_REPLY;
+	memcpy(PUT_REPLY.protocol, myftp_protocol, 6);
+	PUT_REPLY.type = 0xAA;
+    
+	// Tell the client we take sparse FILE_DATA
+	PUT_REPLY.status = MYFTP_SPARSE;
+	PUT_REPLY.length = htonl(12);
+	send_packet(client_socket, &PUT_REPLY, 12);
+	LOG(LOG_LEVEL_DEBUG, "wait and receive FILE_DATA");
+    
+	// Wait and receive FILE_DATA
+	struct message_s FILE_DATA;
+	receive_packet(client_socket, &FILE_DATA, 12);
+	if (memcmp(FILE_DATA.protocol, myftp_protocol,6) !=0 || FILE_DATA.type != (char)0xFF || ntohl(FILE_DATA.length) < 12) {
+		LOG(LOG_LEVEL_WARN, "Received wrong data. Connection closed.");
+		free(payload);
+		return;
+	}
+	long long len_of_payload = (unsigned int)ntohl(FILE_DATA.length) - 12;
+	snprintf(event->name, sizeof(event->name), "%s", payload);
+	event->size = len_of_payload;
+	
+	// Stream the body to a temporary file next to the stored one, discarding it if that cannot be created
+	int fd = -1;
+	char filename[PATH_MAX], temp[PATH_MAX];
+	if (!validFilename(payload)) {
+		LOG(LOG_LEVEL_WARN, "Invalid file name. Upload discarded.");
+	} else {
+		buildPath(payload, filename, sizeof(filename), true);
+		snprintf(temp, sizeof(temp), "%.*s" UPLOAD_PREFIX "XXXXXX", (int)(strrchr(filename, '/') + 1 - filename), filename);
+		if ((fd = mkstemp(temp)) < 0 || fchmod(fd, 0644) < 0) {
+			LOG(LOG_LEVEL_ERROR, "Cannot create %s, %s", temp, strerror(errno));
+			if (fd >= 0) {
+				close(fd);
+				unlink(temp);
+				fd = -1;
+			}
+		}
+	}
+	long long received;
+	if (FILE_DATA.status & MYFTP_SPARSE) {
+		received = len_of_payload = pipe_receive_sparse(client_socket, fd);
+		event->size = received;
+	} else {
+		received = pipe_receive_file(client_socket, fd, len_of_payload);
+	}
+	if (fd < 0) {
+		free(payload);
+		return;
+	}
+	close(fd);
+	if (received < 0 || received != len_of_payload) {
+		if (received == -1) {
+			LOG(LOG_LEVEL_ERROR, "Cannot write %s, %s", temp, strerror(errno));
+		} else {
+			LOG(LOG_LEVEL_WARN, "Upload incomplete.");
+		}
+		unlink(temp);
+		free(payload);
+		return;
+	}
+	
+	// Readers of the old copy keep it, new ones only ever see a complete file
+	if (rename(temp, filename) < 0) {
+		LOG(LOG_LEVEL_ERROR, "Cannot store %s, %s", filename, strerror(errno));
+		unlink(temp);
+		free(payload);
+		return;
+	}
+	if (sharded_storage) {
+		indexAdd(payload);
+	}
+	free(payload);
+	event->status = 1;
+	LOG(LOG_LEVEL_INFO, "File uploaded.");
+    
+	return;
+}
+
+// Compare the client's copy, sent after the file name, with ours
+bool notModified(int fd, struct stat *st, const char *payload, int length)
+{
+    struct myftp_stat known;
+    size_t offset = strlen(payload) + 1;
+    unsigned long long hash;
+    
+    if (offset + sizeof(known) > length) {
+        return false;
+    }
+    memcpy(&known, payload + offset, sizeof(known));
+    if (statField(known.size_hi, known.size_lo) != (unsigned long long)st->st_size) {
+        return false;
+    }
+    if (statField(known.mtime_hi, known.mtime_lo) == (unsigned long long)st->st_mtime) {
+        return true;
+    }
+    hash = statField(known.hash_hi, known.hash_lo);
+    return hash != 0 && hash == pipe_hash_file(fd);
+}
+
+void statFile(struct message_s STAT_REQUEST, int client_socket, struct traceevent *event)
+{
+	// Receive STAT_REQUEST
+	if (STAT_REQUEST.length < 13) {
+		LOG(LOG_LEVEL_WARN, "Received wrong data. Command ignored.");
+		return;
+	}
+	if (STAT_REQUEST.length > 12 + NAME_MAX + 1) {
+		rejectRequest(client_socket);
+		return;
+	}
+	char *payload = calloc(STAT_REQUEST.length - 12 + 1, 1);
+	receive_packet(client_socket, payload, STAT_REQUEST.length - 12);
+	
+	// Send STAT_REPLY
+	struct message_s STAT_REPLY;
+	struct myftp_stat ms;
+	char reply[12 + sizeof(struct myftp_stat)];
+	memcpy(STAT_REPLY.protocol, myftp_protocol, 6);
+	STAT_REPLY.type = 0xAE;
+	int fd = -1;
+	struct stat st;
+	char filename[PATH_MAX];
+	buildPath(payload, filename, sizeof(filename), false);
+	if (!validFilename(payload) || (fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		STAT_REPLY.status = 0;
+		STAT_REPLY.length = htonl(12);
+		memcpy(reply, &STAT_REPLY, 12);
+	} else {
+		STAT_REPLY.status = 1;
+		STAT_REPLY.length = htonl(sizeof(reply));
+		packStat(&ms, &st, (STAT_REQUEST.status & MYFTP_HASH) ? pipe_hash_file(fd) : 0);
+		memcpy(reply, &STAT_REPLY, 12);
+		memcpy(reply + 12, &ms, sizeof(ms));
+		event->size = st.st_size;
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	snprintf(event->name, sizeof(event->name), "%s", payload);
+	event->status = STAT_REPLY.status;
+	free(payload);
+	send_packet(client_socket, reply, ntohl(STAT_REPLY.length));
+	LOG(LOG_LEVEL_DEBUG, "Sent STAT_REPLY");
+	
+	return;
+}
+
+void downloadFile(struct message_s GET_REQUEST, int client_socket, struct traceevent *event)
+{
+	// Receive GET_REQUEST
+	if (GET_REQUEST.length < 13) {
+		LOG(LOG_LEVEL_WARN, "Received wrong data. Command ignored.");
+		return;
+	}
+	if (GET_REQUEST.length > 12 + NAME_MAX + 1 + sizeof(struct myftp_stat)) {
+		rejectRequest(client_socket);
+		return;
+	}
+	int len_of_request = GET_REQUEST.length - 12;
+	char *payload = calloc(len_of_request + 1, 1);
+	receive_packet(client_socket, payload, len_of_request);
+    
+	// Send GET_REPLY
+	struct message_s GET_REPLY;
+	memcpy(GET_REPLY.protocol, myftp_protocol, 6);
+	GET_REPLY.type = 0xA8;
+	int fd = -1;
+	struct stat st;
+	char filename[PATH_MAX];
+	buildPath(payload, filename, sizeof(filename), false);
+	if (!validFilename(payload) || (fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		LOG(LOG_LEVEL_INFO, "The request file is not existed.");
+		GET_REPLY.status = MYFTP_NOT_FOUND;
+	} else if ((GET_REQUEST.status & MYFTP_CONDITIONAL) && notModified(fd, &st, payload, len_of_request)) {
+		GET_REPLY.status = MYFTP_NOT_MODIFIED;
+		event->size = st.st_size;
+	} else if (!(GET_REQUEST.status & MYFTP_SPARSE) && st.st_size > MYFTP_MAX_BODY) {
+		LOG(LOG_LEVEL_WARN, "The request file is too large for a client without sparse transfers.");
+		GET_REPLY.status = MYFTP_NOT_FOUND;
+	} else if ((GET_REQUEST.status & MYFTP_INLINE) && st.st_size <= inline_threshold) {
+		GET_REPLY.status = MYFTP_INLINED;
+		event->size = st.st_size;
+	} else {
+		GET_REPLY.status = MYFTP_FOUND;
+		event->size = st.st_size;
+	}
+	snprintf(event->name, sizeof(event->name), "%s", payload);
+	event->status = GET_REPLY.status;
+	free(payload);
+	if (GET_REPLY.status == MYFTP_NOT_FOUND || !(GET_REQUEST.status & (MYFTP_CONDITIONAL | MYFTP_INLINE))) {
+		GET_REPLY.length = htonl(12);
+		send_packet(client_socket, &GET_REPLY, 12);
+	} else {
+		// Newer clients get our myftp_stat, and small files, in the same send
+		struct myftp_stat ms;
+		size_t len_of_reply = 12 + sizeof(ms) + (GET_REPLY.status == MYFTP_INLINED ? (size_t)st.st_size : 0);
+		char *reply = malloc(len_of_reply);
+		GET_REPLY.length = htonl(len_of_reply);
+		packStat(&ms, &st, 0);
+		memcpy(reply, &GET_REPLY, 12);
+		memcpy(reply + 12, &ms, sizeof(ms));
+		size_t done = 12 + sizeof(ms);
+		ssize_t len;
+		while (done < len_of_reply && (len = pread(fd, reply + done, len_of_reply - done, done - 12 - sizeof(ms))) > 0) {
+			done += len;
+		}
+		if (done < len_of_reply) {
+			// The file shrank under us
+			memset(reply + done, 0, len_of_reply - done);
+		}
+		send_packet(client_socket, reply, (int)len_of_reply);
+		free(reply);
+	}
+	
+	if (GET_REPLY.status != MYFTP_FOUND) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return;
+	}
+	
+	//send FILE_DATA
+	struct message_s FILE_DATA;
+	memcpy(FILE_DATA.protocol, myftp_protocol, 6);
+	FILE_DATA.type = 0xFF;
+	long long len_of_payload = (long long)st.st_size, sent;
+	if (GET_REQUEST.status & MYFTP_SPARSE) {
+		// Only the data extents go over the wire
+		FILE_DATA.status = MYFTP_SPARSE;
+		FILE_DATA.length = htonl(12);
+		send_packet(client_socket, &FILE_DATA, 12);
+		sent = pipe_send_sparse(client_socket, fd, len_of_payload);
+	} else {
+		FILE_DATA.status = 0;
+		FILE_DATA.length = htonl(12 + len_of_payload);
+		send_packet(client_socket, &FILE_DATA, 12);
+		sent = pipe_send_file(client_socket, fd, len_of_payload);
+	}
+	close(fd);
+	if (sent < len_of_payload) {
+		LOG(LOG_LEVEL_WARN, "Download incomplete.");
+		return;
+	}
+	LOG(LOG_LEVEL_INFO, "File downloaded.");
+    
+	return;
+}
+
+void quit(int client_socket, struct sockaddr_in client_addr)
+{
+    // Send QUIT_REPLY
+    memcpy(send_item.protocol, myftp_protocol, 6);
+    send_item.type = 0xac;
+    send_item.length = 12;
+    send_item.length = htonl(send_item.length);
+    send_packet(client_socket, &send_item, 12);
+    close(client_socket);
+    LOG(LOG_LEVEL_INFO, "Connection from %s:%hu is closed", inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
+}
+
+bool waitForOperation(int client_socket, struct sockaddr_in client_addr, unsigned long long session)
+{
+    struct traceevent event;
+    unsigned long long start;
+    bool done = false;
+    struct pollfd fds[2];
+    
+    // Between requests a drain ends the session, requests already sent are still served
+    fds[0].fd = client_socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_pipe[0];
+    fds[1].events = POLLIN;
+    while (poll(fds, 2, -1) < 0 && errno == EINTR);
+    if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) && draining) {
+        LOG(LOG_LEVEL_INFO, "Connection from %s:%hu is closed for restart", inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
+        close(client_socket);
+        return true;
+    }
+    
+    // Wait for request
+    if (receive_packet(client_socket, &received_item, 12) < 12) {
+        LOG(LOG_LEVEL_INFO, "Connection from %s:%hu is lost", inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
+        close(client_socket);
+        return true;
+    }
+    received_item.length = ntohl(received_item.length);
+    start = nowMicros();
+    memset(&event, 0, sizeof(event));
+    event.flags = received_item.status;
+    
+    // Read and determine type of request
+    if (memcmp(received_item.protocol, myftp_protocol, 6) != 0) {
+        LOG(LOG_LEVEL_WARN, "received abnormal data.");
+        return false;
+    }
+    switch ((unsigned char)received_item.type) {
+        case 0xa5:
+            listFile(received_item, client_socket, &event);
+            break;
+        case 0xa7:
+            downloadFile(received_item, client_socket, &event);
+            break;
+        case 0xa9:
+            uploadFile(received_item, client_socket, &event);
+            break;
+        case 0xad:
+            statFile(received_item, client_socket, &event);
+            break;
+        case 0xab:
+            quit(client_socket, client_addr);
+            event.status = 1;
+            done = true;
+            break;
+        default:
+            LOG(LOG_LEVEL_WARN, "received abnormal data.");
+            return false;
+    }
+    traceRecord(session, (unsigned char)received_item.type, start, &event);
+    if (session_broken) {
+        close(client_socket);
+        return true;
+    }
+    
+    return done;
+}
+
+void * pthread_prog(void * args)
+{
+    struct threadargs foo = *(struct threadargs*)args;
+    struct traceevent event;
+    unsigned long long start = nowMicros();
+    unsigned long long session = ((unsigned long long)getpid() << 32) | __sync_add_and_fetch(&session_counter, 1);
+    
+    int opened;
+    
+    free(args);
+    memset(&event, 0, sizeof(event));
+    if ((opened = openConnection(foo.client_socket)) < 0) {
+        close(foo.client_socket);
+    } else {
+        // MYFTP_LOGGED_IN tells replay the client logged in here, no AUTH follows
+        event.status = opened ? MYFTP_LOGGED_IN : 1;
+        event.flags = received_item.status;
+        traceRecord(session, 0xa1, start, &event);
+        start = nowMicros();
+        event.status = 1;
+        if (!opened && !authenticate(foo.client_socket)) {
+            close(foo.client_socket);
+        } else {
+            if (!opened) {
+                event.flags = received_item.status;
+                traceRecord(session, 0xa3, start, &event);
+            }
+            while (!waitForOperation(foo.client_socket, foo.client_addr, session));
+        }
+    }
+    
+    // Counted by serveClients(), so a drain waits for sessions still logging in too
+    __sync_sub_and_fetch(&active_sessions, 1);
+	return 0;
+}
+
+// Accept until we start draining
+void serveClients()
+{
+    pthread_t thread;
+    struct threadargs *args;
+    struct pollfd *fds = (struct pollfd*)calloc(listen_count + 1, sizeof(struct pollfd));
+    socklen_t client_addr_size;
+    int i, on = 1;
+    
+    fds[0].fd = wake_pipe[0];
+    fds[0].events = POLLIN;
+    for (i = 0; i < listen_count; i++) {
+        fds[i + 1].fd = listen_sockets[i];
+        fds[i + 1].events = POLLIN;
+    }
+    
+    while (!draining) {
+        if (poll(fds, listen_count + 1, -1) < 0) {
+            if (errno != EINTR) {
+                LOG(LOG_LEVEL_ERROR, "poll: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+        for (i = 0; i < listen_count && !draining; i++) {
+            if (!(fds[i + 1].revents & POLLIN)) {
+                continue;
+            }
+            
+            // The session thread does the handshake, so a slow client cannot hold up accept
+            args = (struct threadargs*)malloc(sizeof(struct threadargs));
+            client_addr_size = sizeof(args->client_addr);
+            args->client_socket = accept(listen_sockets[i], (struct sockaddr *) &args->client_addr, &client_addr_size);
+            if (args->client_socket < 0) {
+                LOG(LOG_LEVEL_ERROR, "accept: %s", strerror(errno));
+                free(args);
+                continue;
+            }
+            LOG(LOG_LEVEL_INFO, "Connected from %s:%hu", inet_ntoa(args->client_addr.sin_addr), args->client_addr.sin_port);
+            
+            // Requests and replies are small and lock-step, do not let Nagle hold them back
+            setsockopt(args->client_socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            
+            // Create thread
+            __sync_add_and_fetch(&active_sessions, 1);
+            if (pthread_create(&thread, NULL, pthread_prog, args) != 0) {
+                LOG(LOG_LEVEL_ERROR, "pthread_create: %s", strerror(errno));
+                __sync_sub_and_fetch(&active_sessions, 1);
+                close(args->client_socket);
+                free(args);
+                continue;
+            }
+            pthread_detach(thread);
+        }
+    }
+    
+    // Whoever took the sockets over holds its own descriptors
+    for (i = 0; i < listen_count; i++) {
+        close(listen_sockets[i]);
+    }
+    free(fds);
+    return;
+}
+
+// SIGHUP reloads, SIGQUIT stops accepting and drains
+void * controlThread(void * args)
+{
+    sigset_t set;
+    int sig;
+    
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGQUIT);
+    while (sigwait(&set, &sig) == 0) {
+        if (sig == SIGHUP) {
+            reloadConfig();
+        } else if (!draining) {
+            LOG(LOG_LEVEL_INFO, "Stopped accepting, draining %d session(s)", active_sessions);
+            draining = true;
+            if (write(wake_pipe[1], &sig, 1) != 1) {
+                LOG(LOG_LEVEL_ERROR, "wake pipe: %s", strerror(errno));
+            }
+        }
+    }
+    return 0;
+}
+
+// Called with SIGHUP and SIGQUIT blocked, so every thread we start inherits that
+void startControl()
+{
+    pthread_t thread;
+    
+    if (pipe(wake_pipe) < 0) {
+        LOG(LOG_LEVEL_ERROR, "pipe: %s", strerror(errno));
+        exit(1);
+    }
+    if (pthread_create(&thread, NULL, controlThread, NULL) == 0) {
+        pthread_detach(thread);
+    }
+    return;
+}
+
+void blockControlSignals(sigset_t *old)
+{
+    sigset_t set;
+    
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &set, old);
+    return;
+}
+
+// A client that stops reading mid-transfer would hold us forever, so give up after drain_timeout
+void drainSessions()
+{
+    time_t deadline = time(NULL) + drain_timeout;
+    int left;
+    
+    while ((left = __sync_add_and_fetch(&active_sessions, 0)) > 0 && time(NULL) < deadline) {
+        usleep(100000);
+    }
+    if (trace_fd >= 0) {
+        pthread_mutex_lock(&trace_mutex);
+        traceFlush();
+        pthread_mutex_unlock(&trace_mutex);
+    }
+    if (left > 0) {
+        LOG(LOG_LEVEL_WARN, "%d session(s) still open after %u seconds, exiting", left, drain_timeout);
+    } else {
+        LOG(LOG_LEVEL_INFO, "All sessions finished, exiting");
+    }
+    return;
+}
+
+// The CPUs we may run on, a cpuset or container can allow fewer than are online
+int allowedCPUs(int *cpus, int max)
+{
+    int i, count = 0;
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (i = 0; i < CPU_SETSIZE && count < max; i++) {
+            if (CPU_ISSET(i, &set)) {
+                cpus[count++] = i;
+            }
+        }
+    }
+#endif
+    if (count == 0) {
+        count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (count < 1) {
+            count = 1;
+        }
+        if (count > max) {
+            count = max;
+        }
+        for (i = 0; i < count; i++) {
+            cpus[i] = i;
+        }
+    }
+    return count;
+}
+
+void pinToCPU(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        LOG(LOG_LEVEL_ERROR, "sched_setaffinity: %s", strerror(errno));
+    }
+#endif
+    return;
+}
+
+pid_t startWorker(int port, int index, int cpu)
+{
+    int i;
+    sigset_t old, set;
+    pid_t pid;
+    
+    // The worker's control thread takes these, do not let them kill it before that
+    blockControlSignals(&old);
+    pid = fork();
+    if (pid < 0) {
+        LOG(LOG_LEVEL_ERROR, "fork error: %s", strerror(errno));
+    }
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        
+        // Of the signals the supervisor blocks, only the control ones stay blocked
+        sigemptyset(&set);
+        pthread_sigmask(SIG_SETMASK, &set, NULL);
+        blockControlSignals(NULL);
+        log_start(log_rate);
+        pinToCPU(cpu);
+        
+        // The supervisor keeps the sockets, so a restarted worker finds its queue intact
+        for (i = 0; i < listen_count; i++) {
+            if (i != index) {
+                close(listen_sockets[i]);
+            }
+        }
+        listen_sockets[0] = listen_sockets[index];
+        listen_count = 1;
+        if (handoff_socket >= 0) {
+            close(handoff_socket);
+        }
+        startControl();
+        LOG(LOG_LEVEL_INFO, "Worker %d (pid %d) listening on port %d", index, (int)getpid(), port);
+        serveClients();
+        drainSessions();
+        exit(0);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return pid;
+}
+
+// SIGUSR1 logs more, SIGUSR2 logs less
+void changeLogLevel(int sig)
+{
+    if (sig == SIGUSR1 && log_level < LOG_LEVEL_DEBUG) {
+        log_level++;
+    } else if (sig == SIGUSR2 && log_level > LOG_LEVEL_ERROR) {
+        log_level--;
+    }
+}
+
+void stopSupervisor(int sig)
+{
+    if (sig == SIGQUIT) {
+        supervisor_drain = 1;
+    } else if (sig == SIGHUP) {
+        supervisor_reload = 1;
+    } else {
+        supervisor_stop = 1;
+    }
+}
+
+// Only there to make sigsuspend() return when a worker exits
+void wakeSupervisor(int sig)
+{
+}
+
+void signalWorkers(pid_t *pids, int workers, int sig)
+{
+    int i;
+    for (i = 0; i < workers; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], sig);
+        }
+    }
+    return;
+}
+
+void superviseWorkers(int port, int workers)
+{
+    int i, status, cpus[MAX_LISTENERS], cpu_count = allowedCPUs(cpus, MAX_LISTENERS);
+    pid_t pid, *pids;
+    time_t *started;
+    struct sigaction sa;
+    sigset_t set, old;
+    
+    if (workers <= 0) {
+        workers = cpu_count;
+    }
+    if (workers > MAX_LISTENERS) {
+        workers = MAX_LISTENERS;
+    }
+    
+    // One SO_REUSEPORT listener per worker, unless we took them over
+    if (listen_count > 0) {
+        if (listen_count != workers) {
+            LOG(LOG_LEVEL_WARN, "Running %d workers, one per listening socket taken over", listen_count);
+        }
+        workers = listen_count;
+    } else {
+        reuse_port = true;
+        for (i = 0; i < workers; i++) {
+            acceptClient(port);
+            addListener(server_socket);
+        }
+    }
+    pids = (pid_t*)calloc(workers, sizeof(pid_t));
+    started = (time_t*)calloc(workers, sizeof(time_t));
+    
+    // Blocked except inside sigsuspend(), so none arrives between checking the flags and waiting
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stopSupervisor;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGQUIT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = wakeSupervisor;
+    sigaction(SIGCHLD, &sa, NULL);
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, &old);
+    
+    for (i = 0; i < workers; i++) {
+        pids[i] = startWorker(port, i, cpus[i % cpu_count]);
+        started[i] = time(NULL);
+    }
+    if (upgrade_path) {
+        openHandoff(upgrade_path);
+    }
+    confirmHandoff();
+    
+    // Restart any worker that dies until we are told to stop, or all have drained
+    while (!supervisor_stop) {
+        if (supervisor_reload) {
+            // Restarted workers inherit our copy, so reload it too
+            supervisor_reload = 0;
+            reloadConfig();
+            signalWorkers(pids, workers, SIGHUP);
+        }
+        if (supervisor_drain && !draining) {
+            draining = true;
+            LOG(LOG_LEVEL_INFO, "Draining %d workers", workers);
+            signalWorkers(pids, workers, SIGQUIT);
+        }
+        if ((pid = waitpid(-1, &status, WNOHANG)) == 0) {
+            sigsuspend(&old);
+            continue;
+        }
+        if (pid < 0) {
+            if (errno != EINTR) {
+                LOG(LOG_LEVEL_ERROR, "waitpid: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+        for (i = 0; i < workers && pids[i] != pid; i++);
+        if (i == workers || supervisor_stop) {
+            continue;
+        }
+        if (draining) {
+            pids[i] = 0;
+            for (i = 0; i < workers && pids[i] == 0; i++);
+            if (i == workers) {
+                break;
+            }
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            LOG(LOG_LEVEL_WARN, "Worker %d (pid %d) killed by signal %d, restarting", i, (int)pid, WTERMSIG(status));
+        } else {
+            LOG(LOG_LEVEL_WARN, "Worker %d (pid %d) exited with status %d, restarting", i, (int)pid, WEXITSTATUS(status));
+        }
+        // Back off a crash loop (e.g. the port is taken by someone else)
+        if (time(NULL) - started[i] < 1) {
+            sleep(1);
+        }
+        pids[i] = startWorker(port, i, cpus[i % cpu_count]);
+        started[i] = time(NULL);
+    }
+    
+    signalWorkers(pids, workers, SIGTERM);
+    while (wait(NULL) > 0 || errno == EINTR);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    free(pids);
+    free(started);
+    return;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, workers = -1;
+    bool usage = false;
+    char *trace_path = NULL;
+    
+    while ((opt = getopt(argc, argv, "w:st:i:l:r:c:u:e:")) != -1) {
+        switch (opt) {
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 's':
+                sharded_storage = true;
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'i':
+                inline_threshold = inlineBytes(optarg);
+                break;
+            case 'l':
+                if ((log_level = log_parse_level(optarg)) < 0) {
+                    usage = true;
+                }
+                break;
+            case 'r':
+                log_rate = atoi(optarg);
+                break;
+            case 'c':
+                config_path = optarg;
+                break;
+            case 'u':
+                upgrade_path = optarg;
+                break;
+            case 'e':
+                token_lifetime = (unsigned int)atoi(optarg);
+                break;
+            default:
+                usage = true;
+                break;
+        }
+    }
+    if (usage || optind != argc - 1) {
+        printf("Usage: %s [-w workers] [-s] [-t trace] [-i bytes] [-l level] [-r rate] [-c config] [-u socket] [-e seconds] [port]\n", argv[0]);
+        exit(1);
+    }
+    signal(SIGUSR1, changeLogLevel);
+    signal(SIGUSR2, changeLogLevel);
+    
+    // A peer going away mid-transfer is reported by send(), not fatal
+    signal(SIGPIPE, SIG_IGN);
+    if (config_path) {
+        readConfig(config_path);
+    }
+    loadAccounts();
+    openTokenKey();
+    if (upgrade_path) {
+        receiveListeners(upgrade_path);
+    }
+    if (sharded_storage) {
+        openIndex();
+    }
+    if (trace_path) {
+        openTrace(trace_path);
+    }
+    
+    if (workers >= 0) {
+        superviseWorkers(atoi(argv[optind]), workers);
+        return 0;
+    }
+    blockControlSignals(NULL);
+    log_start(log_rate);
+    if (listen_count == 0) {
+        acceptClient(atoi(argv[optind]));
+        addListener(server_socket);
+    }
+    startControl();
+    if (upgrade_path) {
+        openHandoff(upgrade_path);
     }
-    close(tas.client_socket);
-    close(server_socket);
+    confirmHandoff();
+    serveClients();
+    drainSessions();
 	return 0;
 }
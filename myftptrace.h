@@ -0,0 +1,31 @@
+#ifndef __MYFTPTRACE__
+
+#define __MYFTPTRACE__
+
+/*
+ Session trace file written by the server (-t) and read by the replay tool.
+ 
+ The file starts with the 8 byte TRACE_MAGIC, followed by one record per
+ request. Every record is a trace_record header followed by name_length
+ bytes of file name (not NUL terminated). All integers are big-endian.
+ Files starting with TRACE_MAGIC_V1 have records without the flags byte.
+ */
+
+#define TRACE_MAGIC "MYFTPTR2"
+#define TRACE_MAGIC_V1 "MYFTPTR1"
+
+struct trace_record {
+	unsigned int time_hi;	/* start of the request, microseconds since the epoch */
+	unsigned int time_lo;
+	unsigned int session_hi;	/* session id, unique within the trace */
+	unsigned int session_lo;
+	unsigned int size_hi;	/* file bytes for GET/PUT, reply bytes for LIST */
+	unsigned int size_lo;
+	unsigned int duration;	/* microseconds the server spent on the request */
+	unsigned char type;	/* request type, e.g. 0xA7 for GET_REQUEST */
+	unsigned char status;	/* reply status */
+	unsigned short name_length;	/* length of the file name that follows */
+	unsigned char flags;	/* request status flags, e.g. MYFTP_SPARSE or MYFTP_PAGED */
+} __attribute__ ((packed));
+
+#endif